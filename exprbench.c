@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <tinyexpr.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <sched.h>
+
+// Error exit codes
+#define USAGE 1
+
+// Default values for the optional arguments
+#define DEFAULT_CPU 0
+#define DEFAULT_REPS 15
+
+// Nanoseconds per second
+#define NS_PER_SEC 1000000000.0
+
+// Number of points evaluated per expression in each repetition, so every
+// batch size does the same amount of work
+#define POINTS_PER_REP (1 << 18)
+
+// Number of compiles timed per repetition
+#define COMPILES_PER_REP 2000
+
+// Repetitions run and discarded before timing starts
+#define WARMUP_REPS 3
+
+/* Represents the command line arguments passed to the program.
+ */
+typedef struct {
+    int cpu;
+    int reps;
+} Args;
+
+/* Represents an expression evaluator under test. compile returns an opaque
+ * handle bound to the variable x, eval_batch evaluates it at n points
+ * starting at x0 with spacing h and returns the sum of the results.
+ */
+typedef struct {
+    const char* name;
+    void* (*compile)(const char* func, double* x);
+    double (*eval_batch)(void* handle, double* x, double x0, double h, int n);
+    void (*release)(void* handle);
+} Evaluator;
+
+/* Represents the mean and sample standard deviation of a set of timings.
+ */
+typedef struct {
+    double mean;
+    double sd;
+} Summary;
+
+// Expressions representative of what clients send
+static const char* corpus[] = {
+    "3*x^3-2*x^2+x-7",
+    "x^5+x^4+x^3+x^2+x+1",
+    "sin(x)*cos(x)",
+    "tan(x)+sin(2*x)-cos(3*x)",
+    "exp(-x^2)",
+    "pow(x,exp(x))",
+    "exp(sin(x)^2)/(1+x^2)",
+    "((((((x+1)*2)+3)*4)+5)*6)",
+    "sqrt(1+sqrt(1+sqrt(1+sqrt(1+sqrt(1+x)))))",
+    "log(1+abs(sin(x)*exp(cos(x))*sqrt(x^2+1)))",
+    NULL
+};
+
+// Points per call to eval_batch
+static const int batchSizes[] = {1, 64, 4096, 65536};
+#define NUM_BATCH_SIZES (sizeof(batchSizes) / sizeof(batchSizes[0]))
+
+// Keeps results live so evaluation is not optimised away
+static volatile double sink;
+
+static void* tinyexpr_compile(const char* func, double* x) {
+    te_variable vars[] = {{"x", x}};
+    int errPos;
+    return te_compile(func, vars, 1, &errPos);
+}
+
+static double tinyexpr_eval_batch(void* handle, double* x, double x0,
+        double h, int n) {
+    const te_expr* expr = (const te_expr*)handle;
+    double sum = 0;
+    for (int i = 0; i < n; i++) {
+        *x = x0 + i * h;
+        sum += te_eval(expr);
+    }
+    return sum;
+}
+
+static void tinyexpr_release(void* handle) {
+    te_free((te_expr*)handle);
+}
+
+// Evaluators compared by the benchmark
+static const Evaluator evaluators[] = {
+    {"te_eval", tinyexpr_compile, tinyexpr_eval_batch, tinyexpr_release},
+};
+#define NUM_EVALUATORS (sizeof(evaluators) / sizeof(evaluators[0]))
+
+/* Returns the current monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Parses the provided command line arguments into an Args structure. Exits
+ * with the usage message if an option is unknown, missing its value or not
+ * a non-negative integer.
+ *
+ * Returns the Args structure generated.
+ */
+Args parse_args(int argc, char** argv) {
+    Args args;
+    args.cpu = DEFAULT_CPU;
+    args.reps = DEFAULT_REPS;
+    for (int i = 1; i < argc; i += 2) {
+        int value;
+        int n;
+        if (i + 1 >= argc || sscanf(argv[i + 1], "%d%n", &value, &n) != 1
+                || n != strlen(argv[i + 1]) || value < 0) {
+            value = -1;
+        }
+        if (!strcmp(argv[i], "-c") && value >= 0) {
+            args.cpu = value;
+        } else if (!strcmp(argv[i], "-r") && value > 1) {
+            args.reps = value;
+        } else {
+            fprintf(stderr, "Usage: exprbench [-c cpu] [-r repetitions]\n");
+            exit(USAGE);
+        }
+    }
+    return args;
+}
+
+/* Computes the mean and sample standard deviation of the n provided values.
+ *
+ * Returns the Summary generated.
+ */
+Summary summarise(const double* values, int n) {
+    Summary summary = {0, 0};
+    for (int i = 0; i < n; i++) {
+        summary.mean += values[i];
+    }
+    summary.mean /= n;
+    for (int i = 0; i < n; i++) {
+        summary.sd += (values[i] - summary.mean) * (values[i] - summary.mean);
+    }
+    summary.sd = sqrt(summary.sd / (n - 1));
+    return summary;
+}
+
+/* Times compiling the provided expression with the given evaluator, storing
+ * the ns/compile of each repetition in samples.
+ */
+void time_compile(const Evaluator* eval, const char* func, double* samples,
+        int reps) {
+    double x;
+    for (int rep = -WARMUP_REPS; rep < reps; rep++) {
+        uint64_t start = now_ns();
+        for (int i = 0; i < COMPILES_PER_REP; i++) {
+            eval->release(eval->compile(func, &x));
+        }
+        if (rep >= 0) {
+            samples[rep] = (double)(now_ns() - start) / COMPILES_PER_REP;
+        }
+    }
+}
+
+/* Times evaluating the provided compiled expression over POINTS_PER_REP
+ * points in [0, 1) in calls of batch points each, storing the ns/eval of
+ * each repetition in samples.
+ */
+void time_eval(const Evaluator* eval, void* handle, double* x, int batch,
+        double* samples, int reps) {
+    double h = 1.0 / POINTS_PER_REP;
+    for (int rep = -WARMUP_REPS; rep < reps; rep++) {
+        double sum = 0;
+        uint64_t start = now_ns();
+        for (int i = 0; i < POINTS_PER_REP; i += batch) {
+            sum += eval->eval_batch(handle, x, i * h, h, batch);
+        }
+        uint64_t elapsed = now_ns() - start;
+        sink = sum;
+        if (rep >= 0) {
+            samples[rep] = (double)elapsed / POINTS_PER_REP;
+        }
+    }
+}
+
+/* Pins the calling thread to the provided CPU so timings are not disturbed
+ * by migrations. Prints a warning if this is not possible.
+ */
+void pin_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+        fprintf(stderr, "exprbench: unable to pin to cpu %d\n", cpu);
+    }
+}
+
+int main(int argc, char** argv) {
+    Args args = parse_args(argc, argv);
+    pin_cpu(args.cpu);
+    double* samples = malloc(sizeof(double) * args.reps);
+
+    printf("%-10s %-44s %7s %18s %14s\n", "evaluator", "expression",
+            "batch", "ns/op (+/- sd)", "ops/sec");
+    for (int e = 0; e < NUM_EVALUATORS; e++) {
+        const Evaluator* eval = &evaluators[e];
+        for (int f = 0; corpus[f]; f++) {
+            double x;
+            void* handle = eval->compile(corpus[f], &x);
+            if (!handle) {
+                fprintf(stderr, "exprbench: %s cannot compile \"%s\"\n",
+                        eval->name, corpus[f]);
+                continue;
+            }
+            time_compile(eval, corpus[f], samples, args.reps);
+            Summary s = summarise(samples, args.reps);
+            printf("%-10s %-44s %7s %9.1f +/- %5.1f %14.0f\n", eval->name,
+                    corpus[f], "compile", s.mean, s.sd, NS_PER_SEC / s.mean);
+            for (int b = 0; b < NUM_BATCH_SIZES; b++) {
+                time_eval(eval, handle, &x, batchSizes[b], samples,
+                        args.reps);
+                s = summarise(samples, args.reps);
+                printf("%-10s %-44s %7d %9.2f +/- %5.2f %14.0f\n", eval->name,
+                        corpus[f], batchSizes[b], s.mean, s.sd,
+                        NS_PER_SEC / s.mean);
+            }
+            eval->release(handle);
+        }
+    }
+    free(samples);
+    return 0;
+}
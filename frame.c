@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <endian.h>
+#include "frame.h"
+
+// Payload bytes of each fixed size frame type
+#define INTEGRATE_PAYLOAD 28
+#define REPLY_PAYLOAD 14
+
+/* Writes the provided value to buf in network byte order.
+ *
+ * Returns the position after it.
+ */
+static char* put_u16(char* buf, uint16_t value) {
+    value = htobe16(value);
+    memcpy(buf, &value, sizeof(value));
+    return buf + sizeof(value);
+}
+
+static char* put_u32(char* buf, uint32_t value) {
+    value = htobe32(value);
+    memcpy(buf, &value, sizeof(value));
+    return buf + sizeof(value);
+}
+
+/* Writes the IEEE-754 bits of the provided double to buf in network byte
+ * order, so the value is carried exactly.
+ *
+ * Returns the position after it.
+ */
+static char* put_f64(char* buf, double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits = htobe64(bits);
+    memcpy(buf, &bits, sizeof(bits));
+    return buf + sizeof(bits);
+}
+
+/* Reads a value in network byte order from data into value.
+ *
+ * Returns the position after it.
+ */
+static const char* get_u16(const char* data, uint16_t* value) {
+    memcpy(value, data, sizeof(*value));
+    *value = be16toh(*value);
+    return data + sizeof(*value);
+}
+
+static const char* get_u32(const char* data, uint32_t* value) {
+    memcpy(value, data, sizeof(*value));
+    *value = be32toh(*value);
+    return data + sizeof(*value);
+}
+
+static const char* get_f64(const char* data, double* value) {
+    uint64_t bits;
+    memcpy(&bits, data, sizeof(bits));
+    bits = be64toh(bits);
+    memcpy(value, &bits, sizeof(bits));
+    return data + sizeof(bits);
+}
+
+/* Encodes the provided frame into buf, which must hold MAX_FRAME bytes.
+ *
+ * Returns the number of bytes written, or -1 if the frame's expression is
+ * too long to send.
+ */
+int frame_encode(const Frame* frame, char* buf) {
+    char* pos = buf + FRAME_LENGTH;
+    *pos++ = frame->type;
+    pos = put_u32(pos, frame->id);
+    if (frame->type == FRAME_INTERN) {
+        int len = strlen(frame->func);
+        if (len >= MAX_EXPR) {
+            return -1;
+        }
+        memcpy(pos, frame->func, len);
+        pos += len;
+    } else if (frame->type == FRAME_INTEGRATE) {
+        pos = put_u32(pos, frame->exprId);
+        pos = put_f64(pos, frame->low);
+        pos = put_f64(pos, frame->up);
+        pos = put_u32(pos, frame->seg);
+        pos = put_u32(pos, frame->thr);
+    } else {
+        pos = put_u16(pos, frame->status);
+        pos = put_u32(pos, frame->aux);
+        pos = put_f64(pos, frame->result);
+    }
+    put_u32(buf, pos - buf - FRAME_LENGTH);
+    return pos - buf;
+}
+
+/* Decodes the first frame in the provided len bytes of data into frame.
+ *
+ * Returns the number of bytes the frame took up, 0 if data does not hold a
+ * complete frame yet or -1 if the frame is badly formed.
+ */
+int frame_decode(const char* data, int len, Frame* frame) {
+    if (len < FRAME_LENGTH) {
+        return 0;
+    }
+    uint32_t size;
+    const char* pos = get_u32(data, &size);
+    if (size < FRAME_HEADER - FRAME_LENGTH
+            || size > MAX_FRAME - FRAME_LENGTH) {
+        return -1;
+    }
+    if (len < FRAME_LENGTH + size) {
+        return 0;
+    }
+    int payload = size - (FRAME_HEADER - FRAME_LENGTH);
+    frame->type = *pos++;
+    pos = get_u32(pos, &frame->id);
+    if (frame->type == FRAME_INTERN) {
+        if (payload >= MAX_EXPR) {
+            return -1;
+        }
+        memcpy(frame->func, pos, payload);
+        frame->func[payload] = '\0';
+    } else if (frame->type == FRAME_INTEGRATE) {
+        if (payload != INTEGRATE_PAYLOAD) {
+            return -1;
+        }
+        pos = get_u32(pos, &frame->exprId);
+        pos = get_f64(pos, &frame->low);
+        pos = get_f64(pos, &frame->up);
+        pos = get_u32(pos, &frame->seg);
+        get_u32(pos, &frame->thr);
+    } else if (frame->type == FRAME_REPLY) {
+        if (payload != REPLY_PAYLOAD) {
+            return -1;
+        }
+        pos = get_u16(pos, &frame->status);
+        pos = get_u32(pos, &frame->aux);
+        get_f64(pos, &frame->result);
+    } else {
+        return -1;
+    }
+    return FRAME_LENGTH + size;
+}
+
+/* Encodes the provided frame and writes it to f without flushing.
+ *
+ * Returns false if the frame cannot be encoded or written, true otherwise.
+ */
+bool frame_write(FILE* f, const Frame* frame) {
+    char buf[MAX_FRAME];
+    int len = frame_encode(frame, buf);
+    return len > 0 && fwrite(buf, 1, len, f) == len;
+}
+
+/* Reads one whole frame from f into frame.
+ *
+ * Returns false if the stream ended or the frame is badly formed, true
+ * otherwise.
+ */
+bool frame_read(FILE* f, Frame* frame) {
+    char buf[MAX_FRAME];
+    if (fread(buf, 1, FRAME_LENGTH, f) != FRAME_LENGTH) {
+        return false;
+    }
+    uint32_t size;
+    get_u32(buf, &size);
+    if (size > MAX_FRAME - FRAME_LENGTH
+            || fread(buf + FRAME_LENGTH, 1, size, f) != size) {
+        return false;
+    }
+    return frame_decode(buf, FRAME_LENGTH + size, frame) > 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * frame.h
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Address and Upgrade token a client sends to switch its connection from
+// HTTP to binary frames. The server answers 101 Switching Protocols if it
+// agrees and the client sends no frames until it has seen that answer.
+#define BINARY_ADDRESS "/binary"
+#define BINARY_PROTOCOL "intbin"
+
+// Frame types. An intern frame asks the server to validate an expression
+// and give it an ID; an integrate frame asks for an integration of an
+// interned expression. The server answers each with a reply frame carrying
+// the same request ID, in whatever order the requests finish.
+#define FRAME_INTERN 1
+#define FRAME_INTEGRATE 2
+#define FRAME_REPLY 3
+
+// Bytes in the length prefix and in the whole header (length, type, ID)
+#define FRAME_LENGTH 4
+#define FRAME_HEADER 9
+
+// Largest frame accepted, and longest expression that can be interned
+#define MAX_FRAME 2048
+#define MAX_EXPR 1024
+
+/* Represents one binary frame. Only the fields of the frame's type are
+ * used: func for intern frames, exprId to thr for integrate frames and
+ * status to result for replies. aux is the expression ID of a successful
+ * intern or the seconds to wait before retrying a shed integration.
+ */
+typedef struct {
+    uint8_t type;
+    uint32_t id;
+    char func[MAX_EXPR];
+    uint32_t exprId;
+    double low;
+    double up;
+    uint32_t seg;
+    uint32_t thr;
+    uint16_t status;
+    uint32_t aux;
+    double result;
+} Frame;
+
+int frame_encode(const Frame* frame, char* buf);
+int frame_decode(const char* data, int len, Frame* frame);
+
+bool frame_write(FILE* f, const Frame* frame);
+bool frame_read(FILE* f, Frame* frame);
+
+#endif
@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <csse2310a4.h>
+#include <string.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+// Maximum characters in a line
+#define MAX_LINE 1024
+
+// Error exit codes
+#define USAGE 1
+#define CONNECT 2
+#define READ 4
+
+// String Characters
+#define COMMENT '#'
+#define NEWLINE '\n'
+
+// Number of comma-separated fields in an integration job line
+#define INTEGRATE_FIELDS 5
+
+// Default values for the optional arguments
+#define DEFAULT_CONNS 1
+#define DEFAULT_SECONDS 10
+
+// Nanoseconds per second and per microsecond
+#define NS_PER_SEC 1000000000L
+#define NS_PER_US 1000.0
+
+// Size of the buffer used to receive responses
+#define RECV_SIZE 4096
+
+// Status codes reported separately, anything else is counted as "other"
+#define NUM_STATUSES 4
+static const int statusCodes[NUM_STATUSES - 1] = {200, 400, 503};
+
+/* Represents the command line arguments passed to the program.
+ */
+typedef struct {
+    int conns;
+    double rate;
+    double seconds;
+    const char* portNum;
+    char* jobFile;
+} Args;
+
+/* Represents the requests replayed from the job file, each a complete HTTP
+ * request ready to be sent.
+ */
+typedef struct {
+    char** requests;
+    int num;
+} Jobs;
+
+/* Represents the state and results of a single connection. Every field
+ * after id is written only by the connection's own thread.
+ */
+typedef struct {
+    int id;
+    const Args* args;
+    const Jobs* jobs;
+    struct addrinfo* ai;
+    uint64_t start;
+    uint64_t* latencies;
+    long numLatencies;
+    long capLatencies;
+    long statuses[NUM_STATUSES];
+    long errors;
+} Conn;
+
+/* Returns the current monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* Prints the usage message and exits the program.
+ */
+void usage_exit(void) {
+    fprintf(stderr, "Usage: intbench [-c connections] [-r rate] "
+            "[-d seconds] portnum jobfile\n");
+    exit(USAGE);
+}
+
+/* Checks if the line begins with a # and hence is a comment line.
+ *
+ * Returns true if it is a comment and false otherwise.
+ */
+bool is_comment(char* line) {
+    return line[0] == COMMENT;
+}
+
+/* Checks if there are no content in a line and hence is an empty line.
+ *
+ * Returns false if there is a character in the line and true otherwise.
+ */
+bool is_empty(char* line) {
+    for (int i = 0; i < strlen(line); i++) {
+        if (!isspace(line[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Parses the provided string as a positive number, exiting with the usage
+ * message if it is not one.
+ *
+ * Returns the number parsed.
+ */
+double parse_positive(char* str) {
+    double d;
+    int n;
+    if (sscanf(str, "%lf%n", &d, &n) != 1 || n != strlen(str) || d <= 0) {
+        usage_exit();
+    }
+    return d;
+}
+
+/* Parses the provided command line arguments into an Args structure. Exits
+ * with the usage message if an option is unknown or missing its value, a
+ * value is not positive or the port or job file is missing.
+ *
+ * Returns the Args structure generated.
+ */
+Args parse_args(int argc, char** argv) {
+    Args args;
+    args.conns = DEFAULT_CONNS;
+    args.rate = 0;
+    args.seconds = DEFAULT_SECONDS;
+    int i = 1;
+    for (; i < argc - 1 && argv[i][0] == '-'; i += 2) {
+        if (!strcmp(argv[i], "-c")) {
+            args.conns = parse_positive(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-r")) {
+            args.rate = parse_positive(argv[i + 1]);
+        } else if (!strcmp(argv[i], "-d")) {
+            args.seconds = parse_positive(argv[i + 1]);
+        } else {
+            usage_exit();
+        }
+    }
+    if (argc - i != 2 || args.conns < 1) {
+        usage_exit();
+    }
+    args.portNum = argv[i];
+    args.jobFile = argv[i + 1];
+    return args;
+}
+
+/* Builds the HTTP request for one job file line. A line holding only an
+ * expression becomes a /validate/ request and a line in the intclient job
+ * format (function,lower,upper,segments,threads) becomes an /integrate/
+ * request.
+ *
+ * Returns the request generated, or NULL if the line has neither form.
+ */
+char* make_request(char** fields, int num) {
+    char address[MAX_LINE * 2];
+    if (num == 1) {
+        snprintf(address, sizeof(address), "/validate/%s", fields[0]);
+    } else if (num == INTEGRATE_FIELDS) {
+        snprintf(address, sizeof(address), "/integrate/%s/%s/%s/%s/%s",
+                fields[0], fields[1], fields[2], fields[3], fields[4]);
+    } else {
+        return NULL;
+    }
+    char* request = malloc(strlen(address) + strlen("GET  HTTP/1.1\r\n\r\n")
+            + 1);
+    sprintf(request, "GET %s HTTP/1.1\r\n\r\n", address);
+    return request;
+}
+
+/* Reads every non-empty, non-comment line of the provided job file into a
+ * request. Exits if the file cannot be read, a line has the wrong number of
+ * fields or the file holds no requests.
+ *
+ * Returns the Jobs structure generated.
+ */
+Jobs read_jobs(char* jobFile) {
+    FILE* file = fopen(jobFile, "r");
+    if (!file) {
+        fprintf(stderr, "intbench: unable to open \"%s\" for reading\n",
+                jobFile);
+        exit(READ);
+    }
+    Jobs jobs = {NULL, 0};
+    char line[MAX_LINE];
+    int lineNum = 0;
+    while (fgets(line, sizeof(line), file)) {
+        lineNum++;
+        if (is_comment(line) || is_empty(line)) {
+            continue;
+        }
+        char** p = split_by_char(line, NEWLINE, 0);
+        char** fields = split_by_char(p[0], ',', 0);
+        int num = 0;
+        while (fields[num]) {
+            num++;
+        }
+        char* request = make_request(fields, num);
+        free(fields);
+        free(p);
+        if (!request) {
+            fprintf(stderr, "intbench: syntax error on line %d\n", lineNum);
+            exit(READ);
+        }
+        jobs.requests = realloc(jobs.requests, sizeof(char*) * (jobs.num + 1));
+        jobs.requests[jobs.num++] = request;
+    }
+    fclose(file);
+    if (!jobs.num) {
+        fprintf(stderr, "intbench: no requests in \"%s\"\n", jobFile);
+        exit(READ);
+    }
+    return jobs;
+}
+
+/* Opens a connection to the server at the provided address.
+ *
+ * Returns the connected socket, or -1 if the connection failed.
+ */
+int open_conn(struct addrinfo* ai) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)ai->ai_addr, sizeof(struct sockaddr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Sends the provided request on fd and reads until a complete response has
+ * been received.
+ *
+ * Returns the response's status code, or 0 if the connection failed or the
+ * response could not be parsed.
+ */
+int send_request(int fd, char* request) {
+    size_t len = strlen(request);
+    for (size_t sent = 0; sent < len;) {
+        ssize_t n = write(fd, request + sent, len - sent);
+        if (n <= 0) {
+            return 0;
+        }
+        sent += n;
+    }
+
+    char* buffer = NULL;
+    int bufLen = 0;
+    int stat = 0;
+    while (true) {
+        buffer = realloc(buffer, bufLen + RECV_SIZE);
+        ssize_t n = read(fd, buffer + bufLen, RECV_SIZE);
+        if (n <= 0) {
+            break;
+        }
+        bufLen += n;
+        char* expl = NULL;
+        HttpHeader** headers = NULL;
+        char* body = NULL;
+        int numRead = parse_HTTP_response(buffer, bufLen, &stat, &expl,
+                &headers, &body);
+        if (numRead > 0) {
+            free(expl);
+            free(body);
+            free_array_of_headers(headers);
+            break;
+        } else if (numRead < 0) {
+            stat = 0;
+            break;
+        }
+        stat = 0;
+    }
+    free(buffer);
+    return stat;
+}
+
+/* Records the outcome of one request on the provided connection.
+ */
+void record(Conn* conn, int stat, uint64_t latency) {
+    if (!stat) {
+        conn->errors++;
+        return;
+    }
+    if (stat >= 500) {
+        conn->errors++;
+    }
+    int i = 0;
+    while (i < NUM_STATUSES - 1 && statusCodes[i] != stat) {
+        i++;
+    }
+    conn->statuses[i]++;
+    if (conn->numLatencies == conn->capLatencies) {
+        conn->capLatencies = conn->capLatencies ? conn->capLatencies * 2 : 1024;
+        conn->latencies = realloc(conn->latencies,
+                sizeof(uint64_t) * conn->capLatencies);
+    }
+    conn->latencies[conn->numLatencies++] = latency;
+}
+
+/* Replays the job file on a single connection until the run ends. Each
+ * connection starts at a different job so the mix is spread over time.
+ * Without a rate each request is sent as soon as the previous response
+ * arrives. With a rate, requests are scheduled at fixed intervals and
+ * latency is measured from the scheduled time rather than the send time, so
+ * a stalled server is not hidden by the client waiting on it. A failed
+ * connection is reopened before the next request.
+ */
+void* conn_thread(void* arg) {
+    Conn* conn = (Conn*)arg;
+    const Args* args = conn->args;
+    uint64_t end = conn->start + args->seconds * NS_PER_SEC;
+    uint64_t interval = args->rate
+            ? NS_PER_SEC * args->conns / args->rate : 0;
+    uint64_t next = conn->start + interval * conn->id / args->conns;
+    int fd = open_conn(conn->ai);
+
+    for (long i = conn->id; ; i++) {
+        uint64_t sent = now_ns();
+        if (interval) {
+            if (next >= end) {
+                break;
+            }
+            if (sent < next) {
+                struct timespec ts;
+                ts.tv_sec = (next - sent) / NS_PER_SEC;
+                ts.tv_nsec = (next - sent) % NS_PER_SEC;
+                nanosleep(&ts, NULL);
+            }
+            sent = next;
+            next += interval;
+        } else if (sent >= end) {
+            break;
+        }
+        if (fd < 0) {
+            fd = open_conn(conn->ai);
+        }
+        int stat = fd < 0 ? 0
+                : send_request(fd, conn->jobs->requests[i % conn->jobs->num]);
+        record(conn, stat, now_ns() - sent);
+        if (!stat && fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+int compare_latencies(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Returns the value at fraction q of the provided sorted latencies, in
+ * microseconds.
+ */
+double percentile(uint64_t* sorted, long num, double q) {
+    if (!num) {
+        return 0;
+    }
+    long i = q * num;
+    if (i >= num) {
+        i = num - 1;
+    }
+    return sorted[i] / NS_PER_US;
+}
+
+/* Merges the results of every connection and prints them to stdout as a
+ * single JSON object.
+ */
+void report(const Args* args, Conn* conns, double elapsed) {
+    long total = 0;
+    long errors = 0;
+    long statuses[NUM_STATUSES] = {0};
+    for (int i = 0; i < args->conns; i++) {
+        total += conns[i].numLatencies;
+        errors += conns[i].errors;
+        for (int j = 0; j < NUM_STATUSES; j++) {
+            statuses[j] += conns[i].statuses[j];
+        }
+    }
+    uint64_t* all = malloc(sizeof(uint64_t) * (total + 1));
+    long num = 0;
+    double sum = 0;
+    for (int i = 0; i < args->conns; i++) {
+        for (long j = 0; j < conns[i].numLatencies; j++) {
+            all[num++] = conns[i].latencies[j];
+            sum += conns[i].latencies[j];
+        }
+    }
+    qsort(all, num, sizeof(uint64_t), compare_latencies);
+
+    printf("{\"connections\":%d,\"rate\":%g,\"duration_s\":%.3f,"
+            "\"requests\":%ld,\"errors\":%ld,\"status\":{", args->conns,
+            args->rate, elapsed, total, errors);
+    for (int i = 0; i < NUM_STATUSES - 1; i++) {
+        printf("\"%d\":%ld,", statusCodes[i], statuses[i]);
+    }
+    printf("\"other\":%ld},\"throughput_rps\":%.1f,\"latency_us\":{"
+            "\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,"
+            "\"p999\":%.1f,\"max\":%.1f}}\n", statuses[NUM_STATUSES - 1],
+            total / elapsed, num ? sum / num / NS_PER_US : 0,
+            percentile(all, num, 0.5), percentile(all, num, 0.9),
+            percentile(all, num, 0.99), percentile(all, num, 0.999),
+            num ? all[num - 1] / NS_PER_US : 0);
+    free(all);
+}
+
+int main(int argc, char** argv) {
+    Args args = parse_args(argc, argv);
+    Jobs jobs = read_jobs(args.jobFile);
+
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int fd;
+    if (getaddrinfo("localhost", args.portNum, &hints, &ai)
+            || (fd = open_conn(ai)) < 0) {
+        fprintf(stderr, "intbench: unable to connect to port %s\n",
+                args.portNum);
+        return CONNECT;
+    }
+    close(fd);
+
+    Conn* conns = calloc(args.conns, sizeof(Conn));
+    pthread_t* threads = malloc(sizeof(pthread_t) * args.conns);
+    uint64_t start = now_ns();
+    for (int i = 0; i < args.conns; i++) {
+        conns[i].id = i;
+        conns[i].args = &args;
+        conns[i].jobs = &jobs;
+        conns[i].ai = ai;
+        conns[i].start = start;
+        pthread_create(&threads[i], NULL, conn_thread, &conns[i]);
+    }
+    for (int i = 0; i < args.conns; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    report(&args, conns, (double)(now_ns() - start) / NS_PER_SEC);
+
+    freeaddrinfo(ai);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <tinyexpr.h>
@@ -9,6 +10,12 @@
 #include <stdbool.h>
 #include <ctype.h>
 #include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/un.h>
+#include "frame.h"
+#include "shm.h"
 
 // Maximum characters in a line 
 #define MAX_LINE 1024
@@ -31,18 +38,49 @@
 // Minimum values 
 #define MIN_FIELDS 5
 
+// Most dimensions a job file line can integrate over, and the fields (lower
+// and upper bound) each dimension after the first adds
+#define MAX_DIMS 3
+#define FIELDS_PER_DIM 2
+
 // Value of contLen when no headers have been read yet
 #define NO_BODY -1
 
+// Retrying requests the server has shed. The wait before each retry is the
+// server's Retry-After plus a random jitter of up to BACKOFF_BASE_MS 
+// doubled per attempt, capped at BACKOFF_CAP_MS. 
+#define MAX_ATTEMPTS 8
+#define BACKOFF_BASE_MS 50
+#define BACKOFF_CAP_MS 5000
+#define MS_PER_SEC 1000
+#define NS_PER_MS 1000000
+
+// Most integrations sent in binary mode before waiting for a reply
+#define MAX_IN_FLIGHT 64
+
+// Set in the request IDs of intern frames so their replies can be told 
+// apart from those of integrations, which are numbered from zero
+#define INTERN_ID 0x80000000u
+
+// Longest a shared memory client sleeps before checking whether the 
+// server has gone away
+#define HANGUP_CHECK_MS 100
+
+// Usage message
+#define USAGE_MSG "Usage: intclient [-v] [-b] portnum [jobfile]\n"
+
 /* Represents the command line arguments passed to the program.
  */
 typedef struct {
     int verbose;
+    bool binary;
     const char* portNum;
     char* jobFile;
 } Args;
 
-/* Represents the fields included in a job file line. 
+/* Represents the fields included in a job file line. A line integrating 
+ * over x and y, or x, y and z, has dims set and the bounds of y and then z 
+ * in extraLow and extraUp. 
  */
 typedef struct {
     char* func;
@@ -50,21 +88,76 @@ typedef struct {
     double up;
     int seg;
     int thr;
+    int dims;
+    double extraLow[MAX_DIMS - 1];
+    double extraUp[MAX_DIMS - 1];
 } Fields;
 
-/* Reads the given processed job file line and parses each field into a 
- * Fields structure. 
+/* Represents an integration sent in binary mode that has not been printed
+ * yet. 
+ */
+typedef struct {
+    Fields fields;
+    int lineNum;
+    uint32_t exprId;
+    int attempt;
+    bool done;
+    int status;
+    double result;
+} InFlight;
+
+/* Represents the reading and writing ends of the connection to the server.
+ * In binary mode it also holds the expressions interned so far with their 
+ * IDs and a window of the integrations sent but not printed yet, which are
+ * numbered nextPrint up to nextSend and printed in that order whatever 
+ * order their replies arrive in. Binary frames go through the shared 
+ * region shm instead of the socket sock if the server agreed to one. 
+ */
+typedef struct {
+    FILE* to;
+    FILE* from;
+    int sock;
+    bool binary;
+    ShmRegion* shm;
+    char** funcs;
+    uint32_t* funcIds;
+    int numFuncs;
+    uint32_t nextIntern;
+    bool interned;
+    Frame internReply;
+    InFlight window[MAX_IN_FLIGHT];
+    uint32_t nextSend;
+    uint32_t nextPrint;
+} Conn;
+
+/* Returns the number of dimensions of a job file line with the provided 
+ * number of fields: a pair of bounds for each of x, y and z followed by 
+ * segments and threads. 
+ */
+int line_dims(int num) {
+    return (num - MIN_FIELDS) / FIELDS_PER_DIM + 1;
+}
+
+/* Reads the given processed job file line with num fields and parses each 
+ * field into a Fields structure. 
  *
  * Returns the Fields structure generated. 
  */
-Fields parse_fields(char** processed) {
+Fields parse_fields(char** processed, int num) {
     Fields fields;
     
     fields.func = processed[0];
+    fields.dims = line_dims(num);
     sscanf(processed[1], "%lf", &fields.low);
     sscanf(processed[2], "%lf", &fields.up);
-    sscanf(processed[3], "%d", &fields.seg);
-    sscanf(processed[4], "%d", &fields.thr);
+    for (int d = 1; d < fields.dims; d++) {
+        sscanf(processed[1 + d * FIELDS_PER_DIM], "%lf", 
+                &fields.extraLow[d - 1]);
+        sscanf(processed[2 + d * FIELDS_PER_DIM], "%lf", 
+                &fields.extraUp[d - 1]);
+    }
+    sscanf(processed[num - 2], "%d", &fields.seg);
+    sscanf(processed[num - 1], "%d", &fields.thr);
     return fields;
 }
 
@@ -104,39 +197,47 @@ bool is_empty(char* line) {
 }
 
 /* Parses the provided command line arguments into an Args structure depending
- * on what is present. 
+ * on what is present. Options come before portnum: -v selects verbose mode 
+ * and -b asks the server to switch to binary frames. 
  *
  * Returns the Args structure generated. 
  */
 Args parse_args(int argc, char** argv) {
     Args args;
-    if (argv[1][0] == '-') {
-        if (argv[1][1] == 'v') {
+    args.verbose = NORMAL_MODE;
+    args.binary = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp(argv[i], "-v")) {
             args.verbose = VERBOSE_MODE;
+        } else if (!strcmp(argv[i], "-b")) {
+            args.binary = true;
+        } else {
+            fprintf(stderr, USAGE_MSG);
+            exit(USAGE);
         }
-        args.portNum = argv[2];
-    } else {
-        args.verbose = NORMAL_MODE;
-        args.portNum = argv[1];
     }
-    if (args.verbose == VERBOSE_MODE && argc == 4) {
-        args.jobFile = argv[3];
-    } else if (args.verbose == NORMAL_MODE && argc == 3) {
-        args.jobFile = argv[2];
-    } else {
+    args.portNum = argv[i];
+    if (i + 2 == argc) {
+        args.jobFile = argv[i + 1];
+    } else if (i + 1 == argc) {
         args.jobFile = "stdin";
+    } else {
+        args.portNum = NULL;
     }
     return args;
 }
 
 /* Checks each of the fields provided or any syntax errors. This includes: not
- * enough arguments, empty arguments, lower or upper bounds not being in
+ * enough arguments, a number of bounds that is not a pair for each of up to
+ * MAX_DIMS dimensions, empty arguments, lower or upper bounds not being in
  * floating point format and segments or threads not being an integer. 
  *
  * Returns false if any syntax errors are found, true otherwise. 
  */
 bool check_syntax(char** fields, int num) {
-    if (num < MIN_FIELDS) {
+    if (num < MIN_FIELDS || (num - MIN_FIELDS) % FIELDS_PER_DIM 
+            || line_dims(num) > MAX_DIMS) {
         return false;
     }
     for (int i = 0; i < num; i++) {
@@ -159,7 +260,7 @@ bool check_syntax(char** fields, int num) {
             return false;
         }
     }
-    for (int i = 3; i <= num - 1; i++) {
+    for (int i = num - 2; i <= num - 1; i++) {
         int d;
         int n;
         if (!sscanf(fields[i], "%d%n", &d, &n)) {
@@ -179,46 +280,46 @@ bool check_syntax(char** fields, int num) {
 }
 
 /* Allocates memory and builds a null terminated string containing a compete
- * HTTP 1.1 request based on the provided method, address, headers and body.
+ * HTTP 1.1 request based on the provided method, address, headers (NULL 
+ * terminated, may be NULL) and body. 
  *
  * Returns the HTTP request generated. 
  */
 char* construct_http_request(char* method, char* address, 
         HttpHeader** headers, char* body) {
-    char* request = malloc(sizeof(char) * (strlen("  HTTP/1.1\r\n\r\n") 
-            + strlen(method) + strlen(address) + 1));
+    int len = strlen("  HTTP/1.1\r\n\r\n") + strlen(method) 
+            + strlen(address) + 1;
+    for (int i = 0; headers && headers[i]; i++) {
+        len += strlen(": \r\n") + strlen(headers[i]->name) 
+                + strlen(headers[i]->value);
+    }
+    char* request = malloc(sizeof(char) * len);
 
-    if (headers == NULL) {
-        sprintf(request, "%s %s HTTP/1.1\r\n\r\n", method, address);
+    int pos = sprintf(request, "%s %s HTTP/1.1\r\n", method, address);
+    for (int i = 0; headers && headers[i]; i++) {
+        pos += sprintf(request + pos, "%s: %s\r\n", headers[i]->name, 
+                headers[i]->value);
     }
+    sprintf(request + pos, "\r\n");
     return request;
 }
 
-/* Builds the components of the validation request including the GET method 
- * and validation address containing the provided function (func). Passes this
- * string to construct_http_request to build the HTTP request. 
- *
- * Returns the null terminated string generated by constructing the HTTP 
- * request based on the components passed to it. 
+/* Prints an error and exits because the server connection failed or the 
+ * server sent something unexpected. 
  */
-char* make_validation_request(char* func) {
-    char* method = malloc(sizeof(char) * (strlen("GET") + 1));
-    char* address = malloc(sizeof(char) * (strlen("/validate/") 
-            + strlen(func) + 2));
-    HttpHeader** headers = NULL;
-    char* body = NULL;
-
-    sprintf(method, "GET");
-    sprintf(address, "/validate/%s", func);
-
-    return construct_http_request(method, address, headers, body);
+void comms_error(void) {
+    fprintf(stderr, "intclient: communications error\n");
+    exit(COMMS);
 }
 
 /* Reads from the provided file (f) line by line looking for a compete HTTP 
- * response from the server. Will stop reading when a complete response is 
- * read and stores the entire message in a string. 
+ * response from the server. Reads the status line and headers up to the 
+ * first empty line, then reads the number of body bytes given by the 
+ * Content-Length header. Stores the entire message in a string. Prints an 
+ * error and exits if the server closes the connection or the response has 
+ * no Content-Length. 
  *
- * Returns the string containing the complete HTTP request read from the file. 
+ * Returns the string containing the complete HTTP response read from the file. 
  */
 char* read_response(FILE* f) {
     int len = 0;
@@ -227,94 +328,442 @@ char* read_response(FILE* f) {
     int lineNum = 0;
     int contLen = NO_BODY;
     char header[MAX_LINE];
-    bool body = false;
+    bool complete = false;
 
     while (fgets(temp, sizeof(temp), f)) {
         lineNum++;
-        buffer = realloc(buffer, sizeof(char) * (len + strlen(temp)));
-        strcat(buffer, temp);
-        len += (strlen(temp));
-        if (lineNum == 2) {
-            if (temp[0] == NEWLINE) {
+        int tempLen = strlen(temp);
+        buffer = realloc(buffer, sizeof(char) * (len + tempLen + 1));
+        memcpy(buffer + len, temp, tempLen + 1);
+        len += tempLen;
+        if (lineNum >= 2) {
+            if (temp[0] == NEWLINE || temp[0] == CARRIAGE) {
+                complete = true;
                 break;
-            } else {
-                sscanf(temp, "%s %d", header, &contLen);
             }
-        }
-        if (lineNum >= 3) {
-            if (temp[0] == NEWLINE || temp[0] == CARRIAGE) {
-                if (body) {
-                    break;
-                }
-                if (contLen == 0) {
-                    break;
-                } else if (contLen > 0) {
-                    body = true;
-                } else if (contLen == NO_BODY) {
-                    fprintf(stderr, "intclient: communications error\n");
-                    exit(COMMS);
-                }
-            } else {
-                // other headers
+            int value;
+            if (sscanf(temp, "%s %d", header, &value) == 2 
+                    && !strcasecmp(header, "Content-Length:")) {
+                contLen = value;
             }
         }
     }
+    if (!complete || contLen == NO_BODY) {
+        comms_error();
+    }
+    buffer = realloc(buffer, sizeof(char) * (len + contLen + 1));
+    if (fread(buffer + len, sizeof(char), contLen, f) != contLen) {
+        comms_error();
+    }
+    buffer[len + contLen] = '\0';
     return buffer;
 }
 
-/* Creates a duplicated file descriptior from the provided fd and opens a 
- * reading and writing end to communicate with the server. Sends the server 
- * a validation request and waits for a response. The response is parsed into 
- * HTTP response fields and the status return value is checked. 
+/* Sleeps before retrying a shed request. The wait is the provided 
+ * Retry-After value (in seconds, may be NULL) plus a random jitter that 
+ * grows with the attempt number, so clients shed together do not all come
+ * back together. 
+ */
+void backoff(char* retryAfter, int attempt) {
+    long waitMs = retryAfter ? atol(retryAfter) * MS_PER_SEC : 0;
+    long jitterMs = BACKOFF_BASE_MS << attempt;
+    if (jitterMs > BACKOFF_CAP_MS) {
+        jitterMs = BACKOFF_CAP_MS;
+    }
+    waitMs += random() % (jitterMs + 1);
+    struct timespec ts;
+    ts.tv_sec = waitMs / MS_PER_SEC;
+    ts.tv_nsec = (waitMs % MS_PER_SEC) * NS_PER_MS;
+    nanosleep(&ts, NULL);
+}
+
+/* Sends a GET request for the provided address to the server and waits for
+ * the response. A 503 response is retried after backing off, up to 
+ * MAX_ATTEMPTS times. Prints an error and exits if the response cannot be 
+ * parsed. 
  *
- * Returns true if the status is 200, false if the status is 400 and prints an
- * error and exits if any errors occur (repsonse couldn't be parsed or status
- * is something unknown) 
+ * Returns the status of the final response and stores its body in body. 
  */
-bool check_func(char* func, int fd) {
-    int fd2 = dup(fd);
-    FILE* to = fdopen(fd, "w");
-    FILE* from = fdopen(fd2, "r");
-    fputs(make_validation_request(func), to);
-    fflush(to);
-    
-    char* buffer = read_response(from);
+int send_request(Conn* conn, char* address, char** body) {
+    HttpHeader** headers = NULL;
+    int stat = 0;
+    for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+        char* request = construct_http_request("GET", address, NULL, NULL);
+        fputs(request, conn->to);
+        fflush(conn->to);
+        free(request);
+
+        char* buffer = read_response(conn->from);
+        char* expl = NULL;
+        *body = NULL;
+        if (!parse_HTTP_response(buffer, strlen(buffer), &stat, &expl, 
+                &headers, body)) {
+            comms_error();
+        }
+        free(buffer);
+        free(expl);
+        if (stat != 503) {
+            break;
+        }
+        char* retryAfter = NULL;
+        for (int i = 0; headers && headers[i]; i++) {
+            if (!strcasecmp(headers[i]->name, "Retry-After")) {
+                retryAfter = headers[i]->value;
+            }
+        }
+        if (attempt < MAX_ATTEMPTS - 1) {
+            backoff(retryAfter, attempt);
+            free(*body);
+        }
+        free_array_of_headers(headers);
+        headers = NULL;
+    }
+    if (headers) {
+        free_array_of_headers(headers);
+    }
+    return stat;
+}
 
+/* Asks the server to switch the connection to the binary frame protocol 
+ * with the provided Upgrade token and waits for its answer. 
+ *
+ * Returns true if the server switched, false if it answered with anything 
+ * else, in which case the connection carries on with HTTP. 
+ */
+bool negotiate_binary(Conn* conn, char* protocol) {
+    HttpHeader upgrade = {"Upgrade", protocol};
+    HttpHeader connection = {"Connection", "Upgrade"};
+    HttpHeader* headers[] = {&upgrade, &connection, NULL};
+    char* request = construct_http_request("GET", BINARY_ADDRESS, headers, 
+            NULL);
+    fputs(request, conn->to);
+    fflush(conn->to);
+    free(request);
+
+    char* buffer = read_response(conn->from);
     int stat = 0;
     char* expl = NULL;
-    HttpHeader** headers = NULL;
+    HttpHeader** respHeaders = NULL;
     char* body = NULL;
+    if (!parse_HTTP_response(buffer, strlen(buffer), &stat, &expl, 
+            &respHeaders, &body)) {
+        comms_error();
+    }
+    free(buffer);
+    free(expl);
+    free(body);
+    free_array_of_headers(respHeaders);
+    return stat == 101;
+}
 
-    int numRead = parse_HTTP_response(buffer, strlen(buffer), &stat, 
-            &expl, &headers, &body);
-    if (numRead) { 
-        if (stat == 400) {
-            return false;
-        } else if (stat == 200) {
-            return true;
-        } else {
-            fprintf(stderr, "intclient: communications error\n");
-            exit(COMMS);
+/* Prints the outcome of an integration of the provided fields from job file
+ * line lineNum: the result if stat is 200, otherwise an error saying why it
+ * was not done. 
+ */
+void report(Fields fields, int lineNum, int stat, double result) {
+    if (stat == 200) {
+        printf("The integral of %s from %lf to %lf", fields.func, 
+                fields.low, fields.up);
+        for (int d = 1; d < fields.dims; d++) {
+            printf(" by %lf to %lf", fields.extraLow[d - 1], 
+                    fields.extraUp[d - 1]);
         }
+        printf(" is %lf\n", result);
+        fflush(stdout);
+    } else if (stat == 503) {
+        fprintf(stderr, "intclient: server busy, integration skipped "
+                "(line %d)\n", lineNum);
     } else {
-        fprintf(stderr, "intclient: communications error\n");
-        exit(COMMS);
+        fprintf(stderr, "intclient: integration failed (line %d)\n", 
+                lineNum);
     }
+}
 
-    free(buffer);
-    fclose(from);
+/* Checks without blocking whether the server on the socket fd has hung up.
+ *
+ * Returns true if it has, false otherwise. 
+ */
+bool hung_up(int fd) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLRDHUP;
+    return poll(&pfd, 1, 0) > 0 
+            && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+/* Sends the provided frame to the server, encoding it straight into the 
+ * shared region's request ring if the connection has one. Prints an error
+ * and exits if it cannot be sent. 
+ */
+void send_frame(Conn* conn, Frame* frame) {
+    if (!conn->shm) {
+        if (!frame_write(conn->to, frame) || fflush(conn->to)) {
+            comms_error();
+        }
+        return;
+    }
+    char* space;
+    while (!(space = shm_reserve(&conn->shm->requests, MAX_FRAME))) {
+        sched_yield();
+    }
+    int len = frame_encode(frame, space);
+    if (len < 0) {
+        comms_error();
+    }
+    shm_publish(&conn->shm->requests, len);
+    shm_notify(&conn->shm->server);
+}
+
+/* Receives the next frame from the server into frame, waiting on the 
+ * shared region's client futex if the connection has one. Prints an error
+ * and exits if the connection fails. 
+ */
+void recv_frame(Conn* conn, Frame* frame) {
+    if (!conn->shm) {
+        if (!frame_read(conn->from, frame)) {
+            comms_error();
+        }
+        return;
+    }
+    ShmRegion* shm = conn->shm;
+    while (true) {
+        uint32_t seen = __atomic_load_n(&shm->client.seq, __ATOMIC_ACQUIRE);
+        int avail;
+        const char* data = shm_peek(&shm->replies, &avail);
+        if (data) {
+            int len = frame_decode(data, avail, frame);
+            if (len <= 0) {
+                comms_error();
+            }
+            shm_consume(&shm->replies, len);
+            return;
+        }
+        if (!shm_wait(&shm->client, seen, HANGUP_CHECK_MS) 
+                && hung_up(conn->sock)) {
+            comms_error();
+        }
+    }
+}
+
+/* Sends the binary mode integration numbered seq to the server. 
+ */
+void send_integration(Conn* conn, uint32_t seq) {
+    InFlight* slot = &conn->window[seq % MAX_IN_FLIGHT];
+    Frame frame;
+    frame.type = FRAME_INTEGRATE;
+    frame.id = seq;
+    frame.exprId = slot->exprId;
+    frame.low = slot->fields.low;
+    frame.up = slot->fields.up;
+    frame.seg = slot->fields.seg;
+    frame.thr = slot->fields.thr;
+    send_frame(conn, &frame);
+}
+
+/* Prints the outcome of each finished integration at the front of the 
+ * window, stopping at the first still waiting for its reply so results come
+ * out in job file order. 
+ */
+void print_ready(Conn* conn) {
+    while (conn->nextPrint != conn->nextSend) {
+        InFlight* slot = &conn->window[conn->nextPrint % MAX_IN_FLIGHT];
+        if (!slot->done) {
+            break;
+        }
+        report(slot->fields, slot->lineNum, slot->status, slot->result);
+        free(slot->fields.func);
+        conn->nextPrint++;
+    }
+}
+
+/* Reads one reply frame from the server and records it against the request
+ * it answers. A shed integration is sent again after backing off, up to 
+ * MAX_ATTEMPTS times. Prints an error and exits if the connection fails or
+ * the reply answers no outstanding request. 
+ */
+void read_reply(Conn* conn) {
+    Frame reply;
+    recv_frame(conn, &reply);
+    if (reply.type != FRAME_REPLY) {
+        comms_error();
+    }
+    if (reply.id & INTERN_ID) {
+        conn->internReply = reply;
+        conn->interned = true;
+        return;
+    }
+    if (reply.id - conn->nextPrint >= conn->nextSend - conn->nextPrint) {
+        comms_error();
+    }
+    InFlight* slot = &conn->window[reply.id % MAX_IN_FLIGHT];
+    if (reply.status == 503 && ++slot->attempt < MAX_ATTEMPTS) {
+        char retryAfter[MAX_LINE];
+        sprintf(retryAfter, "%u", reply.aux);
+        backoff(retryAfter, slot->attempt - 1);
+        send_integration(conn, reply.id);
+        return;
+    }
+    slot->done = true;
+    slot->status = reply.status;
+    slot->result = reply.result;
+    print_ready(conn);
+}
+
+/* Finds the ID of the provided expression on a binary mode connection, 
+ * interning it with the server if it has not been seen before. The server
+ * validates expressions as it interns them. 
+ *
+ * Returns false if the server rejected the expression, true otherwise with
+ * its ID stored in id. 
+ */
+bool intern_func(Conn* conn, char* func, uint32_t* id) {
+    for (int i = 0; i < conn->numFuncs; i++) {
+        if (!strcmp(conn->funcs[i], func)) {
+            *id = conn->funcIds[i];
+            return true;
+        }
+    }
+    if (strlen(func) >= MAX_EXPR) {
+        return false;
+    }
+    Frame frame;
+    frame.type = FRAME_INTERN;
+    frame.id = INTERN_ID | conn->nextIntern++;
+    strcpy(frame.func, func);
+    send_frame(conn, &frame);
+    conn->interned = false;
+    while (!conn->interned) {
+        read_reply(conn);
+    }
+    if (conn->internReply.id != frame.id) {
+        comms_error();
+    }
+    if (conn->internReply.status != 200) {
+        return false;
+    }
+    conn->funcs = realloc(conn->funcs, sizeof(char*) * (conn->numFuncs + 1));
+    conn->funcIds = realloc(conn->funcIds, 
+            sizeof(uint32_t) * (conn->numFuncs + 1));
+    conn->funcs[conn->numFuncs] = strdup(func);
+    conn->funcIds[conn->numFuncs++] = conn->internReply.aux;
+    *id = conn->internReply.aux;
     return true;
 }
 
+/* Sends the server a binary mode integration of the provided fields 
+ * without waiting for its result, first waiting for the oldest outstanding
+ * integration if MAX_IN_FLIGHT are already outstanding. The result is 
+ * printed by print_ready once every earlier integration has been printed. 
+ */
+void queue_integration(Fields fields, int lineNum, Conn* conn) {
+    while (conn->nextSend - conn->nextPrint == MAX_IN_FLIGHT) {
+        read_reply(conn);
+    }
+    InFlight* slot = &conn->window[conn->nextSend % MAX_IN_FLIGHT];
+    slot->fields = fields;
+    slot->fields.func = strdup(fields.func);
+    slot->lineNum = lineNum;
+    slot->attempt = 0;
+    slot->done = false;
+    if (!intern_func(conn, fields.func, &slot->exprId)) {
+        comms_error();
+    }
+    send_integration(conn, conn->nextSend++);
+}
+
+/* Waits for and prints every outstanding binary mode integration. 
+ */
+void drain_integrations(Conn* conn) {
+    while (conn->nextPrint != conn->nextSend) {
+        read_reply(conn);
+    }
+}
+
+/* Writes the name of the provided endpoint for an integration or 
+ * expression with the provided number of dimensions to address: the name
+ * itself for 1, followed by "2d" or "3d" otherwise. 
+ *
+ * Returns the number of characters written. 
+ */
+int endpoint(char* address, const char* name, int dims) {
+    return dims > 1 ? sprintf(address, "/%s%dd/", name, dims) 
+            : sprintf(address, "/%s/", name);
+}
+
+/* Sends the server a validation request for the provided function (func) 
+ * of the provided number of dimensions and waits for a response. In binary
+ * mode the function is interned instead, which validates it. 
+ *
+ * Returns true if the status is 200, false if the status is 400 and prints an
+ * error and exits if any errors occur (repsonse couldn't be parsed or status
+ * is something unknown) 
+ */
+bool check_func(char* func, int dims, Conn* conn) {
+    if (conn->binary) {
+        uint32_t id;
+        return intern_func(conn, func, &id);
+    }
+    char* address = malloc(sizeof(char) * (strlen("/validate3d/") 
+            + strlen(func) + 1));
+    int len = endpoint(address, "validate", dims);
+    strcpy(address + len, func);
+    char* body = NULL;
+    int stat = send_request(conn, address, &body);
+    free(address);
+    free(body);
+
+    if (stat == 400) {
+        return false;
+    } else if (stat == 200) {
+        return true;
+    }
+    comms_error();
+    return false;
+}
+
+/* Sends the server an integration request for the provided fields and waits
+ * for the result. Bounds are sent to full precision; the job file line they
+ * came from is shorter than MAX_LINE, so the address always fits. Prints 
+ * the result, or an error if the server was still too busy after retrying.
+ * In binary mode the request is queued instead. 
+ */
+void integrate(Fields fields, int lineNum, Conn* conn) {
+    if (conn->binary) {
+        queue_integration(fields, lineNum, conn);
+        return;
+    }
+    char address[MAX_LINE * 2];
+    int len = endpoint(address, "integrate", fields.dims);
+    len += snprintf(address + len, sizeof(address) - len, "%s/%.17g/%.17g", 
+            fields.func, fields.low, fields.up);
+    for (int d = 1; d < fields.dims; d++) {
+        len += snprintf(address + len, sizeof(address) - len, 
+                "/%.17g/%.17g", fields.extraLow[d - 1], 
+                fields.extraUp[d - 1]);
+    }
+    snprintf(address + len, sizeof(address) - len, "/%d/%d", fields.seg, 
+            fields.thr);
+    char* body = NULL;
+    int stat = send_request(conn, address, &body);
+
+    double result = 0;
+    if (stat == 200) {
+        sscanf(body, "%lf", &result);
+    }
+    report(fields, lineNum, stat, result);
+    free(body);
+}
+
 /* Checks the validity of each field within the provided Fields structure. 
- * This includes: no spaces in the function, upper bound is greater than lower
- * bound, segments and threads are greater than zero, segments is a integer
- * multiple of threads and function is a valid expression of x. The appropriate
- * error message is printed if a validation error occurs. 
+ * This includes: no spaces in the function, each upper bound is greater than
+ * its lower bound, segments and threads are greater than zero, segments is a
+ * integer multiple of threads, a 2-D or 3-D line is not sent in binary mode
+ * and function is a valid expression of x, or of x, y and z. The 
+ * appropriate error message is printed if a validation error occurs. 
  *
  * Returns false if any validation errors occur, true otherwise. 
  * */
-bool check_validity(Fields fields, int num, int lineNum, int fd) {
+bool check_validity(Fields fields, int num, int lineNum, Conn* conn) {
     for (int i = 0; i < strlen(fields.func); i++) {
         if (isspace(fields.func[i])) {
             fprintf(stderr, "intclient: spaces not permitted in expression " 
@@ -322,7 +771,11 @@ bool check_validity(Fields fields, int num, int lineNum, int fd) {
             return false;
         }
     }
-    if (fields.up <= fields.low) {
+    bool ordered = fields.up > fields.low;
+    for (int d = 1; d < fields.dims; d++) {
+        ordered &= fields.extraUp[d - 1] > fields.extraLow[d - 1];
+    }
+    if (!ordered) {
         fprintf(stderr, "intclient: upper bound must be greater than lower " 
                 "bound (line %d)\n", lineNum);
         return false;
@@ -342,8 +795,13 @@ bool check_validity(Fields fields, int num, int lineNum, int fd) {
                 "threads (line %d)\n", lineNum);
         return false;
     }
+    if (conn->binary && fields.dims > 1) {
+        fprintf(stderr, "intclient: multi-dimensional integration not "
+                "supported in binary mode (line %d)\n", lineNum);
+        return false;
+    }
     // CHECK FUNC 
-    if (!check_func(fields.func, fd)) {
+    if (!check_func(fields.func, fields.dims, conn)) {
         fprintf(stderr, "intclient: bad expression \"%s\" (line %d)\n", 
                 fields.func, lineNum);
         return false;
@@ -354,9 +812,11 @@ bool check_validity(Fields fields, int num, int lineNum, int fd) {
 
 /* Reads from the file at the provided jobFile path line by line, parses the 
  * non-empty line into comma-separated fields and checks the syntax and 
- * validity of line. This is looped until EOF is reached. 
+ * validity of line. Valid lines are sent to the server to be integrated. 
+ * This is looped until EOF is reached, then any integrations still 
+ * outstanding in binary mode are waited for. 
  */
-void read_file(char* jobFile, int fd) {
+void read_file(char* jobFile, Conn* conn) {
     char line[MAX_LINE];
     int lineNum = 0;
     FILE* file;
@@ -384,11 +844,13 @@ void read_file(char* jobFile, int fd) {
             fprintf(stderr, "intclient: syntax error on line %d\n", lineNum);
             continue;
         }
-        Fields fields = parse_fields(processed);
-        if (!check_validity(fields, j, lineNum, fd)) {
+        Fields fields = parse_fields(processed, j);
+        if (!check_validity(fields, j, lineNum, conn)) {
             continue;
         }
+        integrate(fields, lineNum, conn);
     }
+    drain_integrations(conn);
 }
 
 /* Checks the provided args structure contains a portNum field. 
@@ -402,43 +864,100 @@ bool check_args(Args args) {
     return true;
 }
 
-int main(int argc, char** argv) {
-    if (argc < 2 || argc > 4) {
-        fprintf(stderr, "Usage: intclient [-v] portnum [jobfile]\n");
-        return USAGE;
-    }
-    Args args;
-    args = parse_args(argc, argv);
-    // other usage errors
-    if (!check_args(args)) {
-        fprintf(stderr, "Usage: intclient [-v] portnum [jobfile]\n");
-        return USAGE;
+/* Connects to the server at the provided portNum: a TCP port on localhost,
+ * or the path of the server's Unix domain socket if it contains a '/'. 
+ *
+ * Returns the connected socket, or -1 if the connection failed. 
+ */
+int connect_server(const char* portNum) {
+    if (strchr(portNum, '/')) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+        addr.sun_family = AF_UNIX;
+        if (strlen(portNum) >= sizeof(addr.sun_path)) {
+            return -1;
+        }
+        strcpy(addr.sun_path, portNum);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+            return -1;
+        }
+        return fd;
     }
 
-    check_file(args.jobFile);
-
-    //connect to port
     struct addrinfo* ai = 0;
     struct addrinfo hints;
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_family = AF_INET;   
     hints.ai_socktype = SOCK_STREAM;
     int err;
-    if ((err = getaddrinfo("localhost", args.portNum, &hints, &ai))) {
+    if ((err = getaddrinfo("localhost", portNum, &hints, &ai))) {
         freeaddrinfo(ai);
-        fprintf(stderr, "intclient: unable to connect to port %s\n", 
-                args.portNum);
-        return CONNECT;
+        return -1;
     }
 
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (connect(fd, (struct sockaddr*)ai->ai_addr, sizeof(struct sockaddr))) {
+        return -1;
+    }
+    return fd;
+}
+
+/* Switches the provided connection to binary frames if the server agrees. 
+ * A local connection (over a Unix domain socket) first asks to carry the 
+ * frames in shared memory, passing the server the shared region once it 
+ * agrees. Prints an error and exits if the region cannot be set up after 
+ * the server has agreed to it. 
+ */
+void start_binary(Conn* conn, bool local) {
+    if (local && negotiate_binary(conn, SHM_PROTOCOL)) {
+        int shmFd = shm_create(&conn->shm);
+        if (shmFd < 0 || !shm_send_fd(conn->sock, shmFd)) {
+            comms_error();
+        }
+        close(shmFd);
+        conn->binary = true;
+        return;
+    }
+    conn->binary = negotiate_binary(conn, BINARY_PROTOCOL);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, USAGE_MSG);
+        return USAGE;
+    }
+    Args args;
+    args = parse_args(argc, argv);
+    // other usage errors
+    if (!check_args(args)) {
+        fprintf(stderr, USAGE_MSG);
+        return USAGE;
+    }
+
+    check_file(args.jobFile);
+
+    int fd = connect_server(args.portNum);
+    if (fd < 0) {
         fprintf(stderr, "intclient: unable to connect to port %s\n", 
                 args.portNum);
         return CONNECT;
     }
     
-    read_file(args.jobFile, fd);
+    Conn conn;
+    memset(&conn, 0, sizeof(Conn));
+    conn.sock = fd;
+    conn.to = fdopen(fd, "w");
+    conn.from = fdopen(dup(fd), "r");
+    srandom(time(NULL) ^ getpid());
+    if (args.binary) {
+        start_binary(&conn, strchr(args.portNum, '/') != NULL);
+    }
+    read_file(args.jobFile, &conn);
+    if (conn.shm) {
+        __atomic_store_n(&conn.shm->closed, 1, __ATOMIC_RELEASE);
+        shm_notify(&conn.shm->server);
+    }
 
     return 0;
 }
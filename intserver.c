@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <csse2310a4.h>
@@ -10,6 +11,21 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <limits.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <math.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "stats.h"
+#include "uring.h"
+#include "frame.h"
+#include "shm.h"
+#include "store.h"
+#include "reduce.h"
+#include "trace.h"
 
 // Max charactres in a line
 #define MAX_LINE 1024
@@ -19,6 +35,12 @@
 #define LISTEN 3
 #define VALIDATE 4
 #define INTEGRATE 5
+#define STATS 6
+#define ESTIMATE 7
+#define BINARY 8
+#define RESULT_STORE 9
+#define TRACE 10
+#define TRACE_FILE 11
 
 // Minimum and maximum values
 #define MIN_ARGC 2
@@ -28,8 +50,145 @@
 #define MIN_THR 0
 #define NUM_FIELDS 5
 
-// Value of contLen when no headers have been read yet
-#define NO_BODY -1
+// Most dimensions an integration can have, the extra fields (lower and 
+// upper bound) each dimension after the first adds, and the most cells the
+// grid of a 2-D or 3-D integration may have
+#define MAX_DIMS 3
+#define FIELDS_PER_DIM 2
+#define MAX_CELLS (1LL << 50)
+
+// Points along each edge of a tile of a 2-D or 3-D integration. Tiles are
+// the unit workers take from a chunk, each holding about 4096 points.
+#define TILE_EDGE_2D 64
+#define TILE_EDGE_3D 16
+
+// Integration rules: the trapezoidal rule over a grid, or quasi-Monte Carlo
+// over a Halton sequence when the address ends in QMC_QUERY
+#define RULE_TRAPEZOID 0
+#define RULE_QMC 1
+#define QMC_QUERY "?rule=qmc"
+
+// Randomly shifted copies of the Halton sequence a quasi-Monte Carlo 
+// integration averages, which give its standard error, the points of the 
+// sequence generated at a time and the seed of the shifts
+#define QMC_SHIFTS 8
+#define QMC_BATCH 64
+#define QMC_SEED 0x9E3779B97F4A7C15ULL
+
+// Number of segments a worker integrates between checks of its job's
+// cancellation flag
+#define CANCEL_CHECK_SEGS 4096
+
+// Number of segments of a chunk a worker integrates before putting the chunk
+// back on its queue so cheaper work can run
+#define SLICE_SEGS (1 << 20)
+
+// Priority classes jobs are queued in, cheapest first
+#define NUM_CLASSES 3
+#define CLASS_INTERACTIVE 0
+#define CLASS_NORMAL 1
+#define CLASS_BULK 2
+
+// Predicted run times in seconds below which a job is interactive or normal
+#define INTERACTIVE_SECS 0.01
+#define NORMAL_SECS 1.0
+
+// Estimated cost of evaluating each kind of expression node, in units
+#define LEAF_UNITS 1
+#define ARITH_UNITS 2
+#define TRANSCENDENTAL_UNITS 15
+
+// Starting guess for the time one cost unit takes, and the weight given to
+// each completed job when refining it
+#define INITIAL_NS_PER_UNIT 2.0
+#define NS_PER_UNIT_WEIGHT 0.2
+
+// tinyexpr's node type for constants, which tinyexpr.h does not export
+#define TE_CONSTANT 1
+
+// Values of Args.shards for a single unpinned listener and for one pinned
+// listener per CPU
+#define UNSHARDED 0
+#define AUTO_SHARDS -1
+
+// Values of Args.io selecting how connections are served
+#define IO_THREADS 0
+#define IO_URING 1
+
+// Size of each io_uring backend ring, and the number and size of the 
+// buffers multishot receives are given
+#define URING_ENTRIES 256
+#define URING_BUFS 256
+#define URING_BUF_SIZE 4096
+
+// Tags kept in the low bits of a completion's user data saying which 
+// operation it belongs to. Connections are allocated with malloc, so their
+// addresses leave these bits clear
+#define OP_ACCEPT 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_DONE 3
+#define OP_CANCEL 4
+#define OP_MASK 7
+
+// Default limit on the total segments of admitted but unfinished jobs
+#define DEFAULT_MAX_PENDING 1000000000L
+
+// Rough rate at which one compute thread gets through segments, used to
+// suggest how long a shed client should wait
+#define SEGS_PER_WORKER_SEC 10000000L
+#define MAX_RETRY_AFTER 30
+
+// Most expressions one binary mode connection may intern
+#define MAX_INTERNED 65536
+
+// Most integrations one binary mode connection may have running at once
+#define MAX_RUNNING 256
+
+// Outcomes of running an integration for a client: it finished, the client
+// hung up first, or it could not be started
+#define RUN_DONE 0
+#define RUN_HUNG_UP 1
+#define RUN_REFUSED 2
+
+// Values of Exchange.upgrade for the protocols a connection may switch to
+#define NO_UPGRADE 0
+#define UPGRADE_BINARY 1
+#define UPGRADE_SHM 2
+
+// Longest a shared memory session sleeps before checking whether its 
+// client has gone away without closing the region
+#define HANGUP_CHECK_MS 100
+
+// Values of Job.finished for a job whose wake waiter is being notified, 
+// which may still touch the client's region, and for one whose worker has
+// let go of both the job and the region
+#define JOB_NOTIFYING 1
+#define JOB_RELEASED 2
+
+// Coordinator mode. Integrations of at least COORDINATE_MIN_SEGS segments
+// are split between the peers. A peer that fails is not used for 
+// PEER_RETRY_NS, connecting to or asking a peer gives up after 
+// PEER_TIMEOUT_MS, waiting for a peer's result gives up after 
+// PEER_TIMEOUT_MS plus DEADLINE_FACTOR times the sub-range's estimated run
+// time, and a sub-range still running SLOW_FACTOR times as long as the 
+// fastest finished one is also sent to an idle peer, checking every
+// HEDGE_CHECK_MS. 
+#define COORDINATE_MIN_SEGS 1000000
+#define PEER_RETRY_NS 5000000000ULL
+#define PEER_TIMEOUT_MS 1000
+#define PROBE_CHECK_MS 100
+#define DEADLINE_FACTOR 10
+#define SLOW_FACTOR 2
+#define HEDGE_CHECK_MS 50
+
+// Peer index of a sub-range integrated by the coordinator's own pool, and
+// of no peer at all
+#define LOCAL_PIECE -1
+#define NO_PEER -1
+
+// Bases of the Halton sequence along x, y and z
+static const int haltonBases[MAX_DIMS] = {2, 3, 5};
 
 // Charcter literals
 #define NEWLINE '\n'
@@ -41,9 +200,21 @@
 typedef struct {
     char* portNum;
     int maxThr;
+    long maxPending;
+    int shards;
+    int io;
+    char* unixPath;
+    char* peers;
+    char* storePath;
+    long traceEvery;
+    char* tracePath;
 } Args;
 
-/* Represents the fields included in a job file line. 
+/* Represents the fields included in a job file line. A 2-D or 3-D 
+ * integration over x, y and z has dims set and the bounds of y and then z 
+ * in extraLow and extraUp; seg is then the number of segments along each 
+ * axis. For a quasi-Monte Carlo integration seg is instead the number of 
+ * points of each shifted sequence. 
  */
 typedef struct {
     char* func;
@@ -51,20 +222,305 @@ typedef struct {
     double up;
     int seg;
     int thr;
+    int dims;
+    double extraLow[MAX_DIMS - 1];
+    double extraUp[MAX_DIMS - 1];
+    int rule;
 } Fields;
 
+/* Represents the predicted cost of an integration job. units is the cost
+ * of one evaluation of the expression and seconds the predicted run time. 
+ */
+typedef struct {
+    int nodes;
+    double units;
+    double seconds;
+    int priority;
+} Estimate;
+
+/* Represents a single /integrate/ request in flight. The request's leaves
+ * (segments, tiles of a 2-D or 3-D grid, or quasi-Monte Carlo points) are 
+ * split into thr chunks of consecutive leaves which are run by the compute
+ * pool in the queue for its priority. Each chunk leaves the nodes of the 
+ * summation tree it finished, for each lane (one, or one per shift for 
+ * quasi-Monte Carlo), in nodes at chunk * lanes + lane. Workers check the 
+ * cancelled flag between blocks of CANCEL_CHECK_SEGS segments and abandon
+ * the chunk once it is set. The last chunk to finish signals doneFd and, 
+ * if the job has a wake waiter, sets finished to JOB_NOTIFYING, notifies 
+ * the waiter and then sets finished to JOB_RELEASED. 
+ * busyNs sums the time workers spent on the job and started is when it 
+ * was submitted. traceId is the ID of the sampled request the job belongs
+ * to, or 0. 
+ */
+typedef struct {
+    Fields fields;
+    SumNode** nodes;
+    int* numNodes;
+    int pending;
+    int cancelled;
+    int doneFd;
+    Estimate estimate;
+    uint64_t busyNs;
+    uint64_t started;
+    int finished;
+    ShmWaiter* wake;
+    uint64_t traceId;
+} Job;
+
+/* Represents one chunk of a Job in the compute pool. A chunk is integrated
+ * in slices of SLICE_SEGS segments, so it carries its own compiled 
+ * expression, its progress and the reductions of each of its job's lanes 
+ * between slices. point holds the x, y and z the expression is evaluated 
+ * at. done counts the chunk's leaves integrated so far. 
+ */
+typedef struct Task {
+    Job* job;
+    int chunk;
+    long done;
+    double point[MAX_DIMS];
+    double prev;
+    Reduction* lanes;
+    te_expr* expr;
+    uint64_t enqueued;
+    struct Task* next;
+} Task;
+
+/* Represents the shared pool of compute threads along with one FIFO queue
+ * of pending tasks per priority class. 
+ */
+typedef struct {
+    Task* heads[NUM_CLASSES];
+    Task* tails[NUM_CLASSES];
+    int depth;
+    int numWorkers;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} Pool;
+
+/* Represents a peer intserver a coordinator hands sub-ranges of large 
+ * integrations to. capacity is the number of compute threads the peer 
+ * advertises in its /stats, 0 until it has been asked, and the peer is not
+ * used before downUntil after it fails. Both are shared between client 
+ * threads. addr is the peer's address, resolved by the probe thread before
+ * it first sets capacity and never changed after. 
+ */
+typedef struct {
+    char* host;
+    char* port;
+    struct sockaddr_in addr;
+    bool resolved;
+    int capacity;
+    uint64_t downUntil;
+} Peer;
+
+/* Represents the state shared between all client threads. No job is split
+ * between more than maxThr chunks. 
+ */
+typedef struct {
+    struct Shard* shards;
+    int numShards;
+    int numWorkers;
+    int maxThr;
+    unsigned long cancelled;
+    long activeConnections;
+    long pendingSegs;
+    long maxPending;
+    unsigned long shed;
+    double nsPerUnit;
+    int unixServ;
+    Peer* peers;
+    int numPeers;
+    Store* store;
+} Server;
+
+/* Represents one listening socket and the compute pool serving the 
+ * connections accepted on it. When sharded, the accepting thread, its 
+ * client threads and the pool's workers all run only on the shard's CPUs. 
+ */
+typedef struct Shard {
+    Pool pool;
+    int serv;
+    bool pinned;
+    cpu_set_t cpus;
+    Server* server;
+} Shard;
+
+// Time a task may wait in each class before it is run ahead of cheaper
+// classes
+static const uint64_t agingNs[NUM_CLASSES] = {0, 100000000, 1000000000};
+
+// Names of the priority classes
+static const char* classNames[NUM_CLASSES] = {
+    "interactive", "normal", "bulk"
+};
+
+/* Represents one HTTP request being served and the response generated for
+ * it, independent of how the connection is served. Admitted /integrate/ 
+ * requests have no response until their job finishes. traceId is the 
+ * request's ID if it is sampled for tracing, 0 otherwise. 
+ */
+typedef struct {
+    uint64_t start;
+    int type;
+    char* request;
+    char* method;
+    char* address;
+    HttpHeader** reqHeaders;
+    char* reqBody;
+    Fields fields;
+    char buffer[MAX_LINE];
+    int stat;
+    char* expl;
+    HttpHeader** headers;
+    char* body;
+    char* stats;
+    char* trace;
+    char result[MAX_LINE];
+    HttpHeader header[2];
+    HttpHeader* headerList[3];
+    int numHeaders;
+    char value[MAX_LINE];
+    int upgrade;
+    double error;
+    uint64_t traceId;
+} Exchange;
+
+/* Represents an integration started by a binary mode connection, which may
+ * finish in any order relative to the connection's other integrations. 
+ */
+typedef struct {
+    Job* job;
+    uint32_t id;
+    uint64_t start;
+} Running;
+
+/* Represents the state of a connection switched to binary frames: the 
+ * expressions it has interned, indexed by ID, the integrations it has 
+ * running and the bytes received but not yet decoded. eof is set once the
+ * client has shut down its side. Replies are written to the shared region 
+ * shm if the connection has one and to to otherwise.
+ */
+typedef struct {
+    FILE* to;
+    ShmRegion* shm;
+    char** funcs;
+    int numFuncs;
+    Running* running;
+    int numRunning;
+    char in[MAX_FRAME];
+    int inLen;
+    bool eof;
+} Session;
+
+/* Represents a connection served by the io_uring backend. in holds bytes 
+ * received but not yet handled and out the response being sent for the 
+ * current exchange. Only one request is handled at a time; requests 
+ * pipelined behind it wait in in. eof is set once the client has shut 
+ * down its side; what it sent before is still served. An integration runs
+ * either as job or, when coordinated, on its own thread, which leaves its
+ * outcome and integral in the connection and signals coordFd. upgrading is
+ * set once the client has asked to switch to binary frames, after which 
+ * nothing more is received on the ring; the connection is handed to a 
+ * thread of its own once the switch is answered, leaving fd -1. ops counts
+ * operations in flight that refer to the connection, which is freed once 
+ * it is closed and none remain. 
+ */
+typedef struct {
+    Shard* shard;
+    int fd;
+    char* in;
+    int inLen;
+    uint64_t arrived;
+    char* out;
+    int outLen;
+    int outSent;
+    uint64_t written;
+    Exchange* ex;
+    Job* job;
+    int coordFd;
+    int outcome;
+    double integral;
+    uint64_t done;
+    int ops;
+    bool eof;
+    bool upgrading;
+    bool closed;
+} UringConn;
+
+/* Represents one sub-range of a coordinated integration, meant for the 
+ * peer with the provided index or for the local pool. 
+ */
+typedef struct {
+    Fields fields;
+    int peer;
+    bool done;
+    double result;
+} Piece;
+
+/* Represents an attempt at integrating a piece, either by a peer over the 
+ * connection fd with its response read into in, or by the local pool as 
+ * job. While connecting the connection is still being made and address is
+ * the request to send once it is. A peer that has not answered by deadline
+ * has failed. A slow piece may have two attempts; the one that loses is 
+ * dead. 
+ */
+typedef struct {
+    int piece;
+    int peer;
+    int fd;
+    bool connecting;
+    char* address;
+    Job* job;
+    char* in;
+    int inLen;
+    uint64_t sent;
+    uint64_t deadline;
+    bool dead;
+} Attempt;
+
+/* Represents a coordinated integration: its pieces, the attempts at them,
+ * the time the fastest piece finished by a peer took and whether a piece 
+ * could be run nowhere. 
+ */
+typedef struct {
+    Piece* pieces;
+    int numPieces;
+    int remaining;
+    Attempt* attempts;
+    int numAttempts;
+    uint64_t fastestNs;
+    bool failed;
+} Coordination;
+
+/* Represents the arguments passed to each client thread. 
+ */
+typedef struct {
+    int fd;
+    bool local;
+    Shard* shard;
+} ClientArgs;
+
 /* Prints associated error message based on the provided error code. Exits 
  * program with code. 
  */
 void err_exit(int code) {
     switch (code) {
         case USAGE:
-            fprintf(stderr, "Usage: intserver portnum [maxthreads]\n");
+            fprintf(stderr, "Usage: intserver [--max-pending segments] "
+                    "[--shards n|auto] [--io threads|uring] [--unix path] "
+                    "[--peers host:port,...] [--store path] [--trace n] "
+                    "[--trace-file path] portnum [maxthreads]\n");
             break;
         case LISTEN:
             fprintf(stderr, "intserver: unable to open socket for "
                     "listening\n");
             break;
+        case RESULT_STORE:
+            fprintf(stderr, "intserver: unable to open result store\n");
+            break;
+        case TRACE_FILE:
+            fprintf(stderr, "intserver: unable to open trace file\n");
+            break;
     }
     exit(code);
 }
@@ -90,34 +546,107 @@ bool is_empty(char* line) {
     return true;
 }
 
-/* Reads the given processed job file line and parses each field into a 
- * Fields structure. 
+/* Reads the given processed job file line of an integration with the 
+ * provided number of dimensions and parses each field into a Fields 
+ * structure. 
  *
  * Returns the Fields structure generated. 
  */
-Fields parse_fields(char** processed) {
+Fields parse_fields(char** processed, int dims) {
     Fields fields;
     
     fields.func = processed[0];
+    fields.dims = dims;
+    fields.rule = RULE_TRAPEZOID;
     sscanf(processed[1], "%lf", &fields.low);
     sscanf(processed[2], "%lf", &fields.up);
-    sscanf(processed[3], "%d", &fields.seg);
-    sscanf(processed[4], "%d", &fields.thr);
+    for (int d = 1; d < dims; d++) {
+        sscanf(processed[1 + d * FIELDS_PER_DIM], "%lf", 
+                &fields.extraLow[d - 1]);
+        sscanf(processed[2 + d * FIELDS_PER_DIM], "%lf", 
+                &fields.extraUp[d - 1]);
+    }
+    int last = NUM_FIELDS + (dims - 1) * FIELDS_PER_DIM - 1;
+    sscanf(processed[last - 1], "%d", &fields.seg);
+    sscanf(processed[last], "%d", &fields.thr);
     return fields;
 }
 
+/* Parses the provided string as a positive integer made up only of digits.
+ *
+ * Returns the integer parsed, or -1 if str is not a positive integer. 
+ */
+long parse_count(char* str) {
+    if (!*str) {
+        return -1;
+    }
+    for (int i = 0; i < strlen(str); i++) {
+        if (!isdigit(str[i])) {
+            return -1;
+        }
+    }
+    long count = strtol(str, NULL, 10);
+    return count > 0 && count < LONG_MAX ? count : -1;
+}
+
 /* Parses the provided command line arguents into an Args structure. Exits 
- * program if any usage errors occur. This include: not enough arguments, 
- * portnum not being an integer, portnum being out of bounds and number of 
- * threads being out of bounds. 
+ * program if any usage errors occur. This include: unknown options or 
+ * option values, not enough arguments, portnum not being an integer, portnum
+ * being out of bounds and number of threads being out of bounds. Options
+ * come before portnum. 
  *
  * Returns the Args structure generated. 
  */
 Args parse_args(int argc, char** argv) {
+    Args args;
+    args.maxPending = DEFAULT_MAX_PENDING;
+    args.shards = UNSHARDED;
+    args.io = IO_THREADS;
+    args.unixPath = NULL;
+    args.peers = NULL;
+    args.storePath = NULL;
+    args.traceEvery = 0;
+    args.tracePath = NULL;
+    int i = 1;
+    for (; i < argc && !strncmp(argv[i], "--", 2); i += 2) {
+        if (i + 1 >= argc) {
+            err_exit(USAGE);
+        }
+        long value = parse_count(argv[i + 1]);
+        if (!strcmp(argv[i], "--shards") && !strcmp(argv[i + 1], "auto")) {
+            args.shards = AUTO_SHARDS;
+        } else if (!strcmp(argv[i], "--io") 
+                && !strcmp(argv[i + 1], "threads")) {
+            args.io = IO_THREADS;
+        } else if (!strcmp(argv[i], "--io") 
+                && !strcmp(argv[i + 1], "uring")) {
+            args.io = IO_URING;
+        } else if (!strcmp(argv[i], "--unix") && argv[i + 1][0]) {
+            args.unixPath = argv[i + 1];
+        } else if (!strcmp(argv[i], "--peers") && argv[i + 1][0]) {
+            args.peers = argv[i + 1];
+        } else if (!strcmp(argv[i], "--store") && argv[i + 1][0]) {
+            args.storePath = argv[i + 1];
+        } else if (!strcmp(argv[i], "--trace-file") && argv[i + 1][0]) {
+            args.tracePath = argv[i + 1];
+        } else if (value < 0) {
+            err_exit(USAGE);
+        } else if (!strcmp(argv[i], "--max-pending")) {
+            args.maxPending = value;
+        } else if (!strcmp(argv[i], "--trace")) {
+            args.traceEvery = value;
+        } else if (!strcmp(argv[i], "--shards") && value <= CPU_SETSIZE) {
+            args.shards = value;
+        } else {
+            err_exit(USAGE);
+        }
+    }
+    argc -= i - 1;
+    argv += i - 1;
+
     if (argc < MIN_ARGC || argc > MAX_ARGC) {
         err_exit(USAGE);
     }
-    Args args;
     for (int i = 1; i < argc; i++) {
         for (int j = 0; j < strlen(argv[i]); j++) {
             if (!isdigit(argv[i][j])) {
@@ -140,16 +669,31 @@ Args parse_args(int argc, char** argv) {
     return args;
 }
 
-/* Checks if the provided expression (func) is a valid expression of x. 
- * Uses provided library: tinyexpr.h to determine this. 
+/* Compiles the provided expression with x, then y and z for 2-D and 3-D 
+ * integrations, bound to the elements of point. 
  *
- * Returns false if the expression cannot be evaluated, true otherwise. 
+ * Returns the compiled expression, or NULL if it is not valid. 
  */
-bool valid_func(char* func) {
-    double x; 
-    te_variable vars[] = {{"x", &x}};
+te_expr* compile_expr(const char* func, int dims, double* point) {
+    te_variable vars[] = {{"x", &point[0]}, {"y", &point[1]}, 
+            {"z", &point[2]}};
     int errPos;
-    te_expr* expr = te_compile(func, vars, 1, &errPos);
+    return te_compile(func, vars, dims, &errPos);
+}
+
+/* Checks if the provided expression (func) is a valid expression of x, or 
+ * of x, y and z up to the provided number of dimensions. Uses provided 
+ * library: tinyexpr.h to determine this. 
+ *
+ * Returns false if the expression cannot be evaluated, true otherwise. 
+ */
+bool valid_func(char* func, int dims) {
+    double point[MAX_DIMS];
+    uint64_t start = stats_now();
+    te_expr* expr = compile_expr(func, dims, point);
+    uint64_t end = stats_now();
+    stats_record_phase(PHASE_COMPILE, end - start);
+    trace_span(trace_current(), "te_compile", start, end, TRACE_NO_ARG);
     if (expr) {
         te_free(expr);
     } else {
@@ -158,80 +702,155 @@ bool valid_func(char* func) {
     return true;
 }
 
+/* Returns the number of dimensions of the expression or integration the 
+ * provided address is for: 2 for an endpoint name ending in "2d", such as 
+ * "/integrate2d/...", 3 for one ending in "3d" and 1 otherwise. 
+ */
+int address_dims(char* address) {
+    char* end = strchr(address + 1, '/');
+    if (end && end - address > 2 && end[-1] == 'd' 
+            && (end[-2] == '2' || end[-2] == '3')) {
+        return end[-2] - '0';
+    }
+    return 1;
+}
+
+/* Returns the integration rule the provided address asks for: RULE_QMC if
+ * it ends in QMC_QUERY, RULE_TRAPEZOID otherwise. 
+ */
+int address_rule(char* address) {
+    char* query = strchr(address, '?');
+    return query && !strcmp(query, QMC_QUERY) ? RULE_QMC : RULE_TRAPEZOID;
+}
+
 /* Extracts the expression from the provided address and checks if it is a 
- * valid expression. 
+ * valid expression, of x, y and z for "/validate2d/..." and 
+ * "/validate3d/...". 
  *
  * Returns false if it is not a valid expresion, true otherwise. 
  */
 int check_func(char* address) {
     char func[MAX_LINE];
-    sscanf(address, "/validate/%s", func);
-    if (!valid_func(func)) {
+    sscanf(strchr(address + 1, '/'), "/%s", func);
+    if (!valid_func(func, address_dims(address))) {
         return false;
     }
     return true;
 }
 
 /* Reads from the provided file (f) line by line looking for a complete HTTP 
- * request from the client. Will stop reading when a complete request is read 
- * and stores the entire message in a string. 
+ * request from the client. Reads the request line and headers up to the
+ * first empty line, then reads the number of body bytes given by a
+ * Content-Length header if one was present. Stores the entire message in a
+ * string and the time its first line arrived in start. 
  *
- * Returns NULL if a badly formed response is read, returns the string 
- * containing the complete HTTP response read from the file otherwise. 
+ * Returns NULL if the client closed the connection or a badly formed request
+ * is read, returns the string containing the complete HTTP request read from
+ * the file otherwise. 
  */
-char* read_request(FILE* f) {
+char* read_request(FILE* f, uint64_t* start) {
     int len = 0;
     char temp[MAX_LINE];
     char* buffer = NULL;
     int lineNum = 0;
-    int contLen = NO_BODY;
+    int contLen = 0;
     char header[MAX_LINE];
-    bool body = false;
-    int broken = 0;
+    bool complete = false;
 
-    while (fgets(temp, sizeof(temp), f) && !feof(f)) {
+    while (fgets(temp, sizeof(temp), f)) {
         lineNum++;
-        buffer = realloc(buffer, sizeof(char) * (len + strlen(temp)));
-        strcat(buffer, temp);
-        len += strlen(temp);
-        if (lineNum == 2) {
-            if (temp[0] == NEWLINE) {
-                break;
-            } else {
-                sscanf(temp, "%s %d", header, &contLen);
-            }
+        if (lineNum == 1) {
+            *start = stats_now();
         }
-        if (lineNum >= 3) {
+        int tempLen = strlen(temp);
+        buffer = realloc(buffer, sizeof(char) * (len + tempLen + 1));
+        memcpy(buffer + len, temp, tempLen + 1);
+        len += tempLen;
+        if (lineNum >= 2) {
             if (temp[0] == NEWLINE || temp[0] == CARRIAGE) {
-                if (body) {
-                    break;
-                }
-                if (contLen == 0) {
-                    break;
-                } else if (contLen > 0) {
-                    body = true;
-                } else if (contLen == NO_BODY) {
-                    broken = 1;
-                    break;
-                }
-            } else {
+                complete = true;
+                break;
+            }
+            int value;
+            if (sscanf(temp, "%s %d", header, &value) == 2 
+                    && !strcasecmp(header, "Content-Length:")) {
+                contLen = value;
             }
         }
     }
 
-    if (broken) {
+    if (!complete || contLen < 0) {
+        free(buffer);
         return NULL;
     }
+    if (contLen > 0) {
+        buffer = realloc(buffer, sizeof(char) * (len + contLen + 1));
+        if (fread(buffer + len, sizeof(char), contLen, f) != contLen) {
+            free(buffer);
+            return NULL;
+        }
+        len += contLen;
+        buffer[len] = '\0';
+    }
     return buffer;
 }
 
+/* Finds the end of the first HTTP message in the provided len bytes of 
+ * data, framing messages the same way as read_request: the start line and
+ * headers end at the first empty line and are followed by the number of 
+ * body bytes given by a Content-Length header. 
+ *
+ * Returns the length of the message, 0 if data does not hold a complete 
+ * message yet or -1 if the message is badly formed. 
+ */
+int message_length(const char* data, int len) {
+    int lineNum = 0;
+    int contLen = 0;
+    int pos = 0;
+    while (pos < len) {
+        const char* newline = memchr(data + pos, NEWLINE, len - pos);
+        if (!newline) {
+            return 0;
+        }
+        int lineLen = newline - (data + pos) + 1;
+        lineNum++;
+        if (lineNum >= 2) {
+            if (data[pos] == NEWLINE || data[pos] == CARRIAGE) {
+                if (contLen < 0) {
+                    return -1;
+                }
+                int total = pos + lineLen + contLen;
+                return total <= len ? total : 0;
+            }
+            char temp[MAX_LINE];
+            char header[MAX_LINE];
+            int n = lineLen < MAX_LINE ? lineLen : MAX_LINE - 1;
+            memcpy(temp, data + pos, n);
+            temp[n] = '\0';
+            int value;
+            if (sscanf(temp, "%s %d", header, &value) == 2 
+                    && !strcasecmp(header, "Content-Length:")) {
+                contLen = value;
+            }
+        }
+        pos += lineLen;
+    }
+    return 0;
+}
+
+
 /* Reads the provided method and address and gets if they are valid. This
- * includes: method being "GET" and address being of the form "/validate/..."
- * or "/integrate/...". 
+ * includes: method being "GET" and address being of the form "/validate/...",
+ * "/integrate/...", either of them with "2d" or "3d" after the name, 
+ * "/estimate/...", "/stats" with an optional query string, "/trace" or 
+ * BINARY_ADDRESS. 
  *
  * Returns 0 if either the method or address is not valid, VALIDATE if the
- * addressis of the form "validate/.." and INTEGRATE if the adress is of the
- * form "integrate/..."
+ * addressis of the form "validate/..", "validate2d/.." or "validate3d/..",
+ * INTEGRATE if the adress is of the form "integrate/...", 
+ * "integrate2d/..." or "integrate3d/...", ESTIMATE if the address is of the
+ * form "estimate/...", STATS if the address is "/stats", TRACE if it is 
+ * "/trace" and BINARY if it is BINARY_ADDRESS. 
  */
 int check_type(int numRead, char* method, char* address) {
     if (numRead <= 0) {
@@ -240,23 +859,39 @@ int check_type(int numRead, char* method, char* address) {
     if (strcmp(method, "GET")) {
         return 0;
     }
+    if (!strcmp(address, "/stats") || !strncmp(address, "/stats?", 7)) {
+        return STATS;
+    }
+    if (!strcmp(address, "/trace")) {
+        return TRACE;
+    }
+    if (!strcmp(address, BINARY_ADDRESS)) {
+        return BINARY;
+    }
     char ignore[MAX_LINE];
-    if (sscanf(address, "/validate/%s", ignore)) {
+    if (sscanf(address, "/validate/%s", ignore)
+            || sscanf(address, "/validate2d/%s", ignore)
+            || sscanf(address, "/validate3d/%s", ignore)) {
         return VALIDATE;
-    } else if (sscanf(address, "/integrate/%s", ignore)) {
+    } else if (sscanf(address, "/integrate/%s", ignore)
+            || sscanf(address, "/integrate2d/%s", ignore)
+            || sscanf(address, "/integrate3d/%s", ignore)) {
         return INTEGRATE;
+    } else if (sscanf(address, "/estimate/%s", ignore)) {
+        return ESTIMATE;
     } 
     return 0;
 }
 
 /* Checks each of the fields provided or any syntax errors. This includes: not
- * enough arguments, empty arguments, lower or upper bounds not being in
- * floating point format and segments or threads not being an integer. 
+ * enough arguments for the provided number of dimensions, empty arguments, 
+ * lower or upper bounds not being in floating point format and segments or
+ * threads not being an integer. 
  *
  * Returns false if any syntax errors are found, true otherwise. 
  */
-bool check_syntax(char** fields, int num) {
-    if (num != NUM_FIELDS) {
+bool check_syntax(char** fields, int num, int dims) {
+    if (num != NUM_FIELDS + (dims - 1) * FIELDS_PER_DIM) {
         return false;
     }
     for (int i = 0; i < num; i++) {
@@ -277,7 +912,7 @@ bool check_syntax(char** fields, int num) {
             return false;
         }
     }
-    for (int i = 3; i <= num - 1; i++) {
+    for (int i = num - 2; i <= num - 1; i++) {
         int d;
         int n;
         if (!sscanf(fields[i], "%d%n", &d, &n)) {
@@ -295,21 +930,24 @@ bool check_syntax(char** fields, int num) {
     return true;
 }
 
-/* Checks the validity of each field within the provided Fields structure. 
- * This includes: no spaces in the function, upper bound is greater than lower
- * bound, segments and threads are greater than zero, segments is a integer
- * multiple of threads and function is a valid expression of x. The appropriate
- * error message is printed if a validation error occurs. 
+/* Checks the numeric fields within the provided Fields structure. This 
+ * includes: each upper bound is greater than its lower bound, segments and
+ * threads are greater than zero, segments is a integer multiple of threads
+ * and a 2-D or 3-D grid has no more than MAX_CELLS cells. 
  *
- * Returns false if any validation errors occur, true otherwise. 
- * */
-bool check_validity(Fields fields, int num) {
-    for (int i = 0; i < strlen(fields.func); i++) {
-        if (isspace(fields.func[i])) {
+ * Returns false if any of them are invalid, true otherwise. 
+ */
+bool check_ranges(Fields fields) {
+    if (fields.up <= fields.low) {
+        return false;
+    }
+    for (int d = 1; d < fields.dims; d++) {
+        if (fields.extraUp[d - 1] <= fields.extraLow[d - 1]) {
             return false;
         }
     }
-    if (fields.up <= fields.low) {
+    if (fields.rule == RULE_TRAPEZOID 
+            && pow(fields.seg, fields.dims) > MAX_CELLS) {
         return false;
     }
     if (fields.seg <= 0) {
@@ -321,155 +959,2732 @@ bool check_validity(Fields fields, int num) {
     if (fields.seg % fields.thr) {
         return false;
     }
+    return true;
+}
+
+/* Checks the validity of each field within the provided Fields structure. 
+ * This includes: no spaces in the function, the numeric fields checked by
+ * check_ranges and function is a valid expression of x, or of x, y and z
+ * up to the integration's number of dimensions. 
+ *
+ * Returns false if any validation errors occur, true otherwise. 
+ * */
+bool check_validity(Fields fields, int num) {
+    for (int i = 0; i < strlen(fields.func); i++) {
+        if (isspace(fields.func[i])) {
+            return false;
+        }
+    }
+    if (!check_ranges(fields)) {
+        return false;
+    }
     // CHECK FUNC 
-    if (!valid_func(fields.func)) {
+    if (!valid_func(fields.func, fields.dims)) {
         return false;
     }
     return true;
 }
 
-/* Extracts the expression from the provided address, splits it by '/' and 
- * parses it into a Fields structure. 
+/* Extracts the fields following the endpoint name in the provided address,
+ * up to any query string, into the provided buffer, splits them by '/' and
+ * parses them into a Fields structure with the rule the query asks for. 
+ * The func field points into buffer so it must outlive the structure. 
  *
  * Returns the fields structure generated. 
  */
-Fields get_fields(char* address) {
-    char fields[MAX_LINE];
-    sscanf(address, "/integrate/%s", fields);
-    printf("%s\n", fields);
-
-    char** processed = split_by_char(fields, '/', 0);
+Fields get_fields(char* address, char* buffer) {
+    buffer[0] = '\0';
+    sscanf(strchr(address + 1, '/'), "/%[^?]", buffer);
 
-    return parse_fields(processed);
+    char** processed = split_by_char(buffer, '/', 0);
+    Fields fields = parse_fields(processed, address_dims(address));
+    fields.rule = address_rule(address);
+    free(processed);
+    return fields;
 }
 
-/* Extracts the expression from the provided address, splits it by '/' and 
- * checks the parts for any syntax errors. Then parses it into a Fields
+/* Extracts the fields following the endpoint name in the provided address, 
+ * up to a query string which may only be QMC_QUERY, splits them by '/' and 
+ * checks the parts for any syntax errors. Then parses it into a Fields 
  * structure and checks that for any validity errors. 
  *
  * Returns false if any syntax or validity errors occur, true otherwise. 
  */
 bool check_integrate(char* address) {
-    char fields[MAX_LINE];
-    sscanf(address, "/integrate/%s", fields);
+    char fields[MAX_LINE] = "";
+    char* query = strchr(address, '?');
+    if (query && strcmp(query, QMC_QUERY)) {
+        return false;
+    }
+    sscanf(strchr(address + 1, '/'), "/%[^?]", fields);
     char** processed = split_by_char(fields, '/', 0);
     int j = 0;
     while (processed[j]) {
         j++;
     }
-    if (!check_syntax(processed, j)) {
+    int dims = address_dims(address);
+    if (!check_syntax(processed, j, dims)) {
         return false;
     }
-    Fields f = parse_fields(processed);
+    Fields f = parse_fields(processed, dims);
+    f.rule = address_rule(address);
     if (!check_validity(f, j)) {
         return false;
     }
     return true;
 }
 
-/* Creates a duplicate file descriptor from the provided fd and opens a 
- * reading and writng end to communicate with the client. Reads a request from
- * the client and responds appropriately based on the request contents. This 
- * loops until client is dead. 
+/* Returns the number of segments of the provided integration, or of cells
+ * of its grid for a 2-D or 3-D integration, or of points evaluated for a 
+ * quasi-Monte Carlo integration. 
  */
-void* client_thread(void* arg) {
-    int fd = *(int*)arg;
-    free(arg);
-    int fd2 = dup(fd);
-    FILE* to = fdopen(fd, "w");
-    FILE* from = fdopen(fd2, "r");
+long job_segments(Fields fields) {
+    if (fields.rule == RULE_QMC) {
+        return (long)fields.seg * QMC_SHIFTS;
+    }
+    long cells = 1;
+    for (int d = 0; d < fields.dims; d++) {
+        cells *= fields.seg;
+    }
+    return cells;
+}
 
-    while (from) {
-        int stat = 0;
-        char* expl = NULL;
-        HttpHeader** reqHeaders = NULL;
-        char* reqBody = NULL;
-        char* request = malloc(sizeof(char));
-        request = read_request(from);
-        if (request == NULL) {
-            close(fd);
-            close(fd2);
-            break;
-        }
-        fflush(from);
-        char* method = NULL;
-        char* address = NULL;
-        HttpHeader** headers = NULL;
-        char* body = NULL;
-        int numRead = parse_HTTP_request(request, strlen(request), 
-                &method, &address, &reqHeaders, &reqBody);
-        int type = check_type(numRead, method, address);
-        if (type == VALIDATE) {
-            if (check_func(address)) {
-                stat = 200;
-                expl = "OK";
-            } 
-        } else if (type == INTEGRATE) {
-            if (check_integrate(address)) {
-                stat = 200;
-                expl = "OK";
-            } 
-        } 
-        if (stat == 0) {
-            stat = 400;
-            expl = "Bad Request";
-        }
-        char* response = malloc(sizeof(char));
-        response = construct_HTTP_response(stat, expl, headers, body);
-        fputs(response, to);
-        fflush(to);
+/* Returns the number of tiles along each axis of the provided 2-D or 3-D 
+ * integration's grid, storing the points along each edge of a tile in edge.
+ */
+long tiles_across(Fields fields, int* edge) {
+    *edge = fields.dims == 2 ? TILE_EDGE_2D : TILE_EDGE_3D;
+    return (fields.seg + *edge) / *edge;
+}
+
+/* Returns the number of leaves of the provided integration's summation 
+ * tree: its segments, the tiles of its grid for a 2-D or 3-D integration or
+ * its points for a quasi-Monte Carlo integration. 
+ */
+long num_leaves(Fields fields) {
+    if (fields.rule == RULE_QMC || fields.dims == 1) {
+        return fields.seg;
     }
-    close(fd);
-    return NULL;
+    int edge;
+    long across = tiles_across(fields, &edge);
+    long tiles = 1;
+    for (int d = 0; d < fields.dims; d++) {
+        tiles *= across;
+    }
+    return tiles;
 }
 
-int main(int argc, char** argv) {
-    Args args;
-    args = parse_args(argc, argv);
+/* Returns the number of separate sums the provided integration keeps: one
+ * per shifted copy for quasi-Monte Carlo, one otherwise. 
+ */
+int num_lanes(Fields fields) {
+    return fields.rule == RULE_QMC ? QMC_SHIFTS : 1;
+}
 
-    struct addrinfo* ai = 0;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;          
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;  
-    int err;
-    if ((err = getaddrinfo(NULL, args.portNum, &hints, &ai))) {
-        freeaddrinfo(ai);
-        err_exit(LISTEN);
+/* Prepares the provided task for its first slice, starting at leaf first: 
+ * compiles its private copy of the expression, so the bound variables are
+ * not shared between workers, and starts a reduction for each lane. 
+ */
+void begin_chunk(Task* task, long first) {
+    Fields f = task->job->fields;
+    uint64_t start = stats_now();
+    task->expr = compile_expr(f.func, f.dims, task->point);
+    trace_span(task->job->traceId, "te_compile", start, stats_now(), 
+            task->chunk);
+    task->lanes = malloc(sizeof(Reduction) * num_lanes(f));
+    for (int r = 0; r < num_lanes(f); r++) {
+        reduce_start(&task->lanes[r], first);
     }
+}
 
-    int serv = socket(AF_INET, SOCK_STREAM, 0);
-    int v = 1;
-    setsockopt(serv, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(v));
+/* Returns the lower bound of the provided integration along the axis with 
+ * the provided index: 0 for x, 1 for y and 2 for z. 
+ */
+double axis_low(Fields fields, int axis) {
+    return axis ? fields.extraLow[axis - 1] : fields.low;
+}
 
-    if (bind(serv, (struct sockaddr*)ai->ai_addr, sizeof(struct sockaddr))) {
-        err_exit(LISTEN);
+/* Returns the upper bound of the provided integration along the axis with 
+ * the provided index: 0 for x, 1 for y and 2 for z. 
+ */
+double axis_up(Fields fields, int axis) {
+    return axis ? fields.extraUp[axis - 1] : fields.up;
+}
+
+/* Returns the product of the trapezoidal rule's weights of the grid point 
+ * with the provided index along each axis of an integration with the 
+ * provided number of dimensions and segments per axis: 1/2 on a boundary 
+ * and 1 inside for every axis. 
+ */
+double point_weight(const int* index, int dims, int seg) {
+    double weight = 1;
+    for (int d = 0; d < dims; d++) {
+        if (index[d] == 0 || index[d] == seg) {
+            weight /= 2;
+        }
     }
+    return weight;
+}
 
-    struct sockaddr_in ad;
-    memset(&ad, 0, sizeof(struct sockaddr_in));
-    socklen_t len = sizeof(struct sockaddr_in);
-    if (getsockname(serv, (struct sockaddr*)&ad, &len)) {
-        err_exit(LISTEN);
+/* Returns the provided index's radical inverse in the provided base: its 
+ * digits mirrored about the radix point, the index'th element of the 
+ * van der Corput sequence in that base. 
+ */
+double radical_inverse(long index, int base) {
+    double inverse = 0;
+    double scale = 1.0 / base;
+    for (; index > 0; index /= base, scale /= base) {
+        inverse += (index % base) * scale;
     }
-    fprintf(stderr, "%d\n", ntohs(ad.sin_port));
-    fflush(stderr);
+    return inverse;
+}
+
+/* Returns the shift along the provided axis of the quasi-Monte Carlo 
+ * sequence copy with the provided index, a uniform value in [0, 1) 
+ * generated by splitmix64 from QMC_SEED so every run uses the same shifts.
+ */
+double qmc_shift(int copy, int axis) {
+    uint64_t z = QMC_SEED * (copy * MAX_DIMS + axis + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return (z >> 11) * 0x1.0p-53;
+}
 
+/* Integrates the next points of the provided task's quasi-Monte Carlo 
+ * chunk, up to SLICE_SEGS evaluations. Leaf i is point i + 1 of the Halton
+ * sequence, computed from its index so chunks share no state, and every 
+ * point is evaluated in each of the QMC_SHIFTS shifted copies of the 
+ * sequence, whose values go to the copy's own lane. Points are 
+ * generated QMC_BATCH at a time into arrays, so the sequence, shift and 
+ * scaling loops are simple enough for the compiler to vectorise; only the
+ * expression is evaluated a point at a time. The job's cancellation flag 
+ * is checked between batches. 
+ *
+ * Returns true if the chunk has points left, false if it is finished or 
+ * was abandoned. 
+ */
+bool run_qmc(Task* task) {
+    Job* job = task->job;
+    Fields f = job->fields;
+    long first = reduce_chunk_first(f.seg, f.thr, task->chunk);
+    long perChunk = reduce_chunk_first(f.seg, f.thr, task->chunk + 1) - first;
+    if (!task->lanes) {
+        begin_chunk(task, first);
+    }
+    double low[MAX_DIMS];
+    double width[MAX_DIMS];
+    double shifts[QMC_SHIFTS][MAX_DIMS];
+    for (int d = 0; d < f.dims; d++) {
+        low[d] = axis_low(f, d);
+        width[d] = axis_up(f, d) - low[d];
+        for (int r = 0; r < QMC_SHIFTS; r++) {
+            shifts[r][d] = qmc_shift(r, d);
+        }
+    }
+    long end = perChunk - task->done > SLICE_SEGS / QMC_SHIFTS 
+            ? task->done + SLICE_SEGS / QMC_SHIFTS : perChunk;
 
-    if (listen(serv, INT_MAX)) {  
-        err_exit(LISTEN);
+    uint64_t began = stats_now();
+    double base[MAX_DIMS][QMC_BATCH];
+    double coords[MAX_DIMS][QMC_BATCH];
+    double values[QMC_BATCH];
+    for (long i = task->done; i < end; i += QMC_BATCH) {
+        if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) {
+            end = perChunk;
+            break;
+        }
+        int n = end - i < QMC_BATCH ? end - i : QMC_BATCH;
+        for (int d = 0; d < f.dims; d++) {
+            for (int k = 0; k < n; k++) {
+                base[d][k] = radical_inverse(first + i + k + 1, 
+                        haltonBases[d]);
+            }
+        }
+        for (int r = 0; r < QMC_SHIFTS; r++) {
+            for (int d = 0; d < f.dims; d++) {
+                for (int k = 0; k < n; k++) {
+                    double u = base[d][k] + shifts[r][d];
+                    u -= u >= 1;
+                    coords[d][k] = low[d] + u * width[d];
+                }
+            }
+            for (int k = 0; k < n; k++) {
+                for (int d = 0; d < f.dims; d++) {
+                    task->point[d] = coords[d][k];
+                }
+                values[k] = te_eval(task->expr);
+            }
+            reduce_add_run(&task->lanes[r], first + i, values, n);
+        }
     }
+    __atomic_add_fetch(&job->busyNs, stats_now() - began, __ATOMIC_RELAXED);
+    task->done = end;
+    return task->done < perChunk;
+}
 
-    int connFd;
-    while (connFd = accept(serv, 0, 0), connFd >= 0) {
-	int* fd = malloc(sizeof(int));
-	*fd = connFd;
-	pthread_t threadId;
-	pthread_create(&threadId, NULL, client_thread, fd);
-	pthread_detach(threadId);
+/* Integrates the next tiles of the provided task's 2-D or 3-D chunk with 
+ * the trapezoidal rule, up to SLICE_SEGS points. The grid's seg + 1 points
+ * per axis are split into square or cubic tiles, which are the leaves of 
+ * the summation tree. Each point is evaluated once and added to its tile's
+ * sum with its weight, in the same order whichever chunk has the tile; 
+ * finish_job scales the total by the cell volume. The job's cancellation 
+ * flag is checked between tiles. 
+ *
+ * Returns true if the chunk has tiles left to integrate, false if it is 
+ * finished or was abandoned. 
+ */
+bool run_tiles(Task* task) {
+    Job* job = task->job;
+    Fields f = job->fields;
+    int edge;
+    int points = f.seg + 1;
+    long across = tiles_across(f, &edge);
+    long numTiles = num_leaves(f);
+    long first = reduce_chunk_first(numTiles, f.thr, task->chunk);
+    long end = reduce_chunk_first(numTiles, f.thr, task->chunk + 1);
+    double h[MAX_DIMS];
+    for (int d = 0; d < f.dims; d++) {
+        h[d] = (axis_up(f, d) - axis_low(f, d)) / f.seg;
     }
-    
-    return 0;
+    if (!task->lanes) {
+        begin_chunk(task, first);
+    }
+
+    uint64_t began = stats_now();
+    long evaluated = 0;
+    long tile = first + task->done;
+    for (; tile < end && evaluated < SLICE_SEGS; tile++) {
+        if (__atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) {
+            tile = end;
+            break;
+        }
+        int from[MAX_DIMS] = {0, 0, 0};
+        int to[MAX_DIMS] = {1, 1, 1};
+        long rest = tile;
+        for (int d = 0; d < f.dims; d++) {
+            from[d] = rest % across * edge;
+            to[d] = from[d] + edge < points ? from[d] + edge : points;
+            rest /= across;
+        }
+        int index[MAX_DIMS];
+        double sum = 0;
+        for (index[2] = from[2]; index[2] < to[2]; index[2]++) {
+            task->point[2] = f.dims > 2 
+                    ? axis_low(f, 2) + index[2] * h[2] : 0;
+            for (index[1] = from[1]; index[1] < to[1]; index[1]++) {
+                task->point[1] = axis_low(f, 1) + index[1] * h[1];
+                for (index[0] = from[0]; index[0] < to[0]; index[0]++) {
+                    task->point[0] = f.low + index[0] * h[0];
+                    sum += point_weight(index, f.dims, f.seg) 
+                            * te_eval(task->expr);
+                }
+            }
+        }
+        reduce_add(&task->lanes[0], tile, sum);
+        evaluated += (long)(to[0] - from[0]) * (to[1] - from[1]) 
+                * (to[2] - from[2]);
+        task->done++;
+    }
+    __atomic_add_fetch(&job->busyNs, stats_now() - began, __ATOMIC_RELAXED);
+    return tile < end;
 }
 
+/* Integrates the next slice of up to SLICE_SEGS segments of the provided
+ * task's chunk with the trapezoidal rule. Each segment is a leaf of the 
+ * summation tree, added to it REDUCE_BATCH at a time. The job's 
+ * cancellation flag is checked every CANCEL_CHECK_SEGS segments and the 
+ * chunk is abandoned once it is set. 
+ *
+ * Returns true if the chunk has segments left to integrate, false if it is
+ * finished or was abandoned. 
+ */
+bool run_slice(Task* task) {
+    Job* job = task->job;
+    Fields f = job->fields;
+    if (f.rule == RULE_QMC) {
+        return run_qmc(task);
+    }
+    if (f.dims > 1) {
+        return run_tiles(task);
+    }
+    int start = reduce_chunk_first(f.seg, f.thr, task->chunk);
+    int perChunk = reduce_chunk_first(f.seg, f.thr, task->chunk + 1) - start;
+    double h = (f.up - f.low) / f.seg;
+    if (!task->lanes) {
+        begin_chunk(task, start);
+        task->point[0] = f.low + start * h;
+        task->prev = te_eval(task->expr);
+    }
+    int end = perChunk - task->done > SLICE_SEGS 
+            ? task->done + SLICE_SEGS : perChunk;
+
+    uint64_t began = stats_now();
+    double values[REDUCE_BATCH];
+    int count = 0;
+    int i;
+    for (i = task->done; i < end; i++) {
+        if ((i - task->done) % CANCEL_CHECK_SEGS == 0 
+                && __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED)) {
+            end = perChunk;
+            break;
+        }
+        task->point[0] = f.low + (double)(start + i + 1) * h;
+        double next = te_eval(task->expr);
+        values[count++] = (task->prev + next) / 2;
+        task->prev = next;
+        if (count == REDUCE_BATCH) {
+            reduce_add_run(&task->lanes[0], start + i + 1 - count, values, 
+                    count);
+            count = 0;
+        }
+    }
+    reduce_add_run(&task->lanes[0], start + i - count, values, count);
+    __atomic_add_fetch(&job->busyNs, stats_now() - began, __ATOMIC_RELAXED);
+    task->done = end;
+    return task->done < perChunk;
+}
+
+/* Hands the summation tree nodes of each lane of the provided task's 
+ * finished chunk to its job and frees the task. A chunk abandoned before
+ * its first slice hands over none. The last chunk of a job to finish 
+ * signals the job's doneFd to wake the waiting client thread, or the job's
+ * wake waiter for a shared memory session. The job, and the region holding
+ * the wake waiter, may be freed as soon as finished is JOB_RELEASED. 
+ */
+void finish_chunk(Task* task) {
+    Job* job = task->job;
+    int lanes = num_lanes(job->fields);
+    for (int r = 0; task->lanes && r < lanes; r++) {
+        reduce_finish(&task->lanes[r]);
+        job->nodes[task->chunk * lanes + r] = task->lanes[r].nodes;
+        job->numNodes[task->chunk * lanes + r] = task->lanes[r].numNodes;
+    }
+    free(task->lanes);
+    te_free(task->expr);
+    free(task);
+    if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        ShmWaiter* wake = job->wake;
+        uint64_t one = 1;
+        write(job->doneFd, &one, sizeof(one));
+        if (wake) {
+            __atomic_store_n(&job->finished, JOB_NOTIFYING, 
+                    __ATOMIC_RELEASE);
+            shm_notify(wake);
+            __atomic_store_n(&job->finished, JOB_RELEASED, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* Adds the provided task to the back of the queue for its job's priority 
+ * class. Must be called with the pool's lock held. 
+ */
+void enqueue(Pool* pool, Task* task) {
+    int priority = task->job->estimate.priority;
+    task->next = NULL;
+    task->enqueued = stats_now();
+    if (pool->tails[priority]) {
+        pool->tails[priority]->next = task;
+    } else {
+        pool->heads[priority] = task;
+    }
+    pool->tails[priority] = task;
+    pool->depth++;
+}
+
+/* Takes the next task to run from the pool. This is the oldest task of the
+ * cheapest non-empty class, unless the oldest task of a more expensive 
+ * class has waited longer than that class's aging limit, in which case it 
+ * goes first so big jobs are not starved. Must be called with the pool's 
+ * lock held. 
+ *
+ * Returns the task taken, or NULL if every queue is empty. 
+ */
+Task* dequeue(Pool* pool) {
+    uint64_t now = stats_now();
+    int chosen = -1;
+    for (int c = NUM_CLASSES - 1; c > 0 && chosen < 0; c--) {
+        if (pool->heads[c] && now - pool->heads[c]->enqueued > agingNs[c]) {
+            chosen = c;
+        }
+    }
+    for (int c = 0; c < NUM_CLASSES && chosen < 0; c++) {
+        if (pool->heads[c]) {
+            chosen = c;
+        }
+    }
+    if (chosen < 0) {
+        return NULL;
+    }
+    Task* task = pool->heads[chosen];
+    pool->heads[chosen] = task->next;
+    if (!pool->heads[chosen]) {
+        pool->tails[chosen] = NULL;
+    }
+    pool->depth--;
+    return task;
+}
+
+/* Repeatedly takes a task from the pool and runs one slice of it. A chunk
+ * with segments left goes to the back of its queue; a finished chunk is 
+ * recorded. Tasks belonging to a cancelled job are finished without being
+ * run so the thread is immediately available for other work. For a traced
+ * job the time the task waited in the queue and the slice are recorded as
+ * spans. Never returns. 
+ */
+void* worker_thread(void* arg) {
+    Pool* pool = (Pool*)arg;
+
+    while (true) {
+        Task* task;
+        pthread_mutex_lock(&pool->lock);
+        while (!(task = dequeue(pool))) {
+            pthread_cond_wait(&pool->ready, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        uint64_t traceId = task->job->traceId;
+        uint64_t began = traceId ? stats_now() : 0;
+        trace_span(traceId, "queue", task->enqueued, began, task->chunk);
+        bool more = false;
+        if (!__atomic_load_n(&task->job->cancelled, __ATOMIC_RELAXED)) {
+            more = run_slice(task);
+            trace_span(traceId, "chunk", began, traceId ? stats_now() : 0, 
+                    task->chunk);
+        }
+        if (more) {
+            pthread_mutex_lock(&pool->lock);
+            enqueue(pool, task);
+            pthread_mutex_unlock(&pool->lock);
+        } else {
+            finish_chunk(task);
+        }
+    }
+    return NULL;
+}
+
+/* Initialises the provided pool and starts numWorkers detached compute 
+ * threads taking tasks from it. If cpus is not NULL the threads only run on
+ * those CPUs. 
+ */
+void start_pool(Pool* pool, int numWorkers, const cpu_set_t* cpus) {
+    for (int c = 0; c < NUM_CLASSES; c++) {
+        pool->heads[c] = NULL;
+        pool->tails[c] = NULL;
+    }
+    pool->depth = 0;
+    pool->numWorkers = numWorkers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->ready, NULL);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (cpus) {
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), cpus);
+    }
+    for (int i = 0; i < numWorkers; i++) {
+        pthread_t threadId;
+        pthread_create(&threadId, &attr, worker_thread, pool);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* Adds one task per chunk of the provided job to the back of the queue for
+ * the job's priority class and wakes the workers. 
+ */
+void submit_job(Pool* pool, Job* job) {
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < job->fields.thr; i++) {
+        Task* task = calloc(1, sizeof(Task));
+        task->job = job;
+        task->chunk = i;
+        enqueue(pool, task);
+    }
+    pthread_cond_broadcast(&pool->ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Checks if the provided function node calls one of the maths library's 
+ * transcendental functions, which cost far more than arithmetic. 
+ *
+ * Returns true if it does, false otherwise. 
+ */
+bool is_transcendental(const te_expr* n) {
+    static double (*const unary[])(double) = {
+        sin, cos, tan, asin, acos, atan, sinh, cosh, tanh, exp, log, log10,
+        sqrt
+    };
+    static double (*const binary[])(double, double) = {pow, atan2, fmod};
+    double (*fn1)(double);
+    double (*fn2)(double, double);
+    memcpy(&fn1, &n->function, sizeof(fn1));
+    memcpy(&fn2, &n->function, sizeof(fn2));
+    for (int i = 0; i < sizeof(unary) / sizeof(unary[0]); i++) {
+        if (fn1 == unary[i]) {
+            return true;
+        }
+    }
+    for (int i = 0; i < sizeof(binary) / sizeof(binary[0]); i++) {
+        if (fn2 == binary[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Estimates the cost of one evaluation of the provided compiled expression
+ * by walking its tree. Variables and constants cost LEAF_UNITS, 
+ * transcendental functions TRANSCENDENTAL_UNITS and other operators 
+ * ARITH_UNITS. Adds the number of nodes visited to nodes. 
+ *
+ * Returns the estimated cost in units. 
+ */
+double expr_units(const te_expr* n, int* nodes) {
+    (*nodes)++;
+    int type = n->type & 0x1F;
+    if (type == TE_VARIABLE || type == TE_CONSTANT) {
+        return LEAF_UNITS;
+    }
+    int arity = (type & (TE_FUNCTION0 | TE_CLOSURE0)) ? (type & 7) : 0;
+    double units = is_transcendental(n) ? TRANSCENDENTAL_UNITS : ARITH_UNITS;
+    for (int i = 0; i < arity; i++) {
+        units += expr_units((const te_expr*)n->parameters[i], nodes);
+    }
+    return units;
+}
+
+/* Predicts the cost of integrating the provided (valid) fields from the 
+ * size of the compiled expression, the number of segments, the parallelism
+ * available in the provided pool and the server's measured time per cost
+ * unit, and picks the 
+ * job's priority class from the predicted run time. 
+ *
+ * Returns the Estimate generated. 
+ */
+Estimate estimate_job(Server* server, Pool* pool, Fields fields) {
+    Estimate estimate;
+    double point[MAX_DIMS];
+    te_expr* expr = compile_expr(fields.func, fields.dims, point);
+    estimate.nodes = 0;
+    estimate.units = expr_units(expr, &estimate.nodes);
+    te_free(expr);
+
+    double nsPerUnit;
+    __atomic_load(&server->nsPerUnit, &nsPerUnit, __ATOMIC_RELAXED);
+    int parallel = fields.thr < pool->numWorkers 
+            ? fields.thr : pool->numWorkers;
+    estimate.seconds = (double)job_segments(fields) * estimate.units 
+            * nsPerUnit 
+            / parallel / 1e9;
+    if (estimate.seconds < INTERACTIVE_SECS) {
+        estimate.priority = CLASS_INTERACTIVE;
+    } else if (estimate.seconds < NORMAL_SECS) {
+        estimate.priority = CLASS_NORMAL;
+    } else {
+        estimate.priority = CLASS_BULK;
+    }
+    return estimate;
+}
+
+/* Refines the server's time per cost unit from the worker time the 
+ * provided finished job actually took. 
+ */
+void learn_cost(Server* server, Job* job) {
+    double units = (double)job_segments(job->fields) * job->estimate.units;
+    if (!job->busyNs || units <= 0) {
+        return;
+    }
+    double nsPerUnit;
+    __atomic_load(&server->nsPerUnit, &nsPerUnit, __ATOMIC_RELAXED);
+    nsPerUnit += NS_PER_UNIT_WEIGHT * (job->busyNs / units - nsPerUnit);
+    __atomic_store(&server->nsPerUnit, &nsPerUnit, __ATOMIC_RELAXED);
+}
+
+/* Waits for either the provided job to finish or the connection to the 
+ * client on fd to fail. A client that has only shut down its side may still
+ * be reading, so it is not taken as having hung up; a reset connection sets
+ * the job's cancellation flag. 
+ *
+ * Returns false if the client hung up, true if the job finished. 
+ */
+bool wait_for_job(Job* job, int fd) {
+    struct pollfd fds[2];
+    fds[0].fd = job->doneFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = fd;
+    fds[1].events = 0;
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            return true;
+        }
+        if (fds[1].revents & (POLLHUP | POLLERR)) {
+            __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+}
+
+/* Returns the largest number no more than limit that divides seg, so a 
+ * piece of seg segments can be given that many threads. 
+ */
+int divisor_at_most(int seg, int limit) {
+    int thr = limit < seg ? limit : seg;
+    while (thr > 1 && seg % thr) {
+        thr--;
+    }
+    return thr > 0 ? thr : 1;
+}
+
+/* Makes a Job for the provided integration fields and hands its chunks to
+ * the provided shard's compute pool. The job refers to fields.func, which 
+ * must stay valid until the job is finished. If wake is not NULL it is 
+ * notified when the job finishes. The job is traced if the calling 
+ * thread's current request is. A job asking for more than the server's 
+ * maxThr threads is given the most that divide its segments evenly; its 
+ * result is the same to the last bit. 
+ *
+ * Returns the job started, or NULL if its doneFd cannot be made. 
+ */
+Job* start_job(Shard* shard, Fields fields, ShmWaiter* wake) {
+    int doneFd = eventfd(0, EFD_CLOEXEC);
+    if (doneFd < 0) {
+        return NULL;
+    }
+    if (fields.thr > shard->server->maxThr) {
+        fields.thr = divisor_at_most(fields.seg, shard->server->maxThr);
+    }
+    Job* job = malloc(sizeof(Job));
+    job->fields = fields;
+    job->estimate = estimate_job(shard->server, &shard->pool, fields);
+    job->busyNs = 0;
+    job->nodes = calloc(fields.thr * num_lanes(fields), sizeof(SumNode*));
+    job->numNodes = calloc(fields.thr * num_lanes(fields), sizeof(int));
+    job->pending = job->fields.thr;
+    job->cancelled = 0;
+    job->doneFd = doneFd;
+    job->started = stats_now();
+    job->finished = 0;
+    job->wake = wake;
+    job->traceId = trace_current();
+    submit_job(&shard->pool, job);
+    return job;
+}
+
+/* Collects the result of the provided job once every chunk has left the 
+ * pool and its doneFd has been read, summing the nodes its chunks handed 
+ * over along the same tree whatever thr is, then frees the job. A job 
+ * that did not complete because its client hung up is counted as 
+ * cancelled, and its nodes are freed without being summed. The result of
+ * a quasi-Monte Carlo job is the mean of its shifted copies' estimates, 
+ * and if error is not NULL their standard error is stored in it (0 for 
+ * other jobs). 
+ *
+ * Returns the integral, or 0 if the job did not complete. 
+ */
+double finish_job(Shard* shard, Job* job, bool completed, double* error) {
+    Server* server = shard->server;
+    if (completed) {
+        learn_cost(server, job);
+    } else {
+        __atomic_add_fetch(&server->cancelled, 1, __ATOMIC_RELAXED);
+    }
+    uint64_t now = stats_now();
+    stats_record_phase(PHASE_INTEGRATE, now - job->started);
+    trace_span(job->traceId, "integrate", job->started, now, TRACE_NO_ARG);
+
+    Fields f = job->fields;
+    int lanes = num_lanes(f);
+    double volume = 1;
+    for (int d = 0; d < f.dims; d++) {
+        volume *= axis_up(f, d) - axis_low(f, d);
+    }
+    double estimates[QMC_SHIFTS];
+    for (int r = 0; r < lanes; r++) {
+        int numNodes = 0;
+        for (int c = 0; c < f.thr; c++) {
+            numNodes += job->numNodes[c * lanes + r];
+        }
+        SumNode* nodes = malloc(sizeof(SumNode) * (numNodes + 1));
+        numNodes = 0;
+        for (int c = 0; c < f.thr; c++) {
+            int n = job->numNodes[c * lanes + r];
+            if (n) {
+                memcpy(nodes + numNodes, job->nodes[c * lanes + r], 
+                        sizeof(SumNode) * n);
+            }
+            numNodes += n;
+            free(job->nodes[c * lanes + r]);
+        }
+        estimates[r] = !completed ? 0 
+                : reduce_total(nodes, numNodes, num_leaves(f)) * volume
+                / (f.rule == RULE_QMC ? f.seg : job_segments(f));
+        free(nodes);
+    }
+
+    double result = 0;
+    double spread = 0;
+    if (f.rule == RULE_QMC) {
+        for (int r = 0; r < QMC_SHIFTS; r++) {
+            result += estimates[r] / QMC_SHIFTS;
+        }
+        for (int r = 0; r < QMC_SHIFTS; r++) {
+            spread += (estimates[r] - result) * (estimates[r] - result);
+        }
+        spread = sqrt(spread / (QMC_SHIFTS * (QMC_SHIFTS - 1)));
+    } else {
+        result = estimates[0];
+    }
+    if (error) {
+        *error = spread;
+    }
+    close(job->doneFd);
+    free(job->nodes);
+    free(job->numNodes);
+    free(job);
+    return result;
+}
+
+/* Returns the result store key of the provided integration fields. A 
+ * job's result is the same to the last bit whatever thr is, so thr is not 
+ * part of the key and every thread count shares one stored result. 
+ */
+StoreKey store_key(Fields fields) {
+    StoreKey key;
+    key.func = fields.func;
+    key.low = fields.low;
+    key.up = fields.up;
+    key.seg = fields.seg;
+    key.rule = STORE_RULE_TRAPEZOID;
+    return key;
+}
+
+/* Looks up the integral of the provided fields in the server's result 
+ * store, if it has one. Only 1-D trapezoidal results are stored. 
+ *
+ * Returns true with the integral stored in result if it was found, false 
+ * otherwise. 
+ */
+bool recall(Server* server, Fields fields, double* result) {
+    StoreKey key = store_key(fields);
+    return server->store && fields.dims == 1 
+            && fields.rule == RULE_TRAPEZOID
+            && store_get(server->store, &key, result);
+}
+
+/* Adds the provided integral of the provided 1-D trapezoidal fields to the
+ * server's result store, if it has one. 
+ */
+void remember(Server* server, Fields fields, double integral) {
+    StoreKey key = store_key(fields);
+    if (server->store && fields.dims == 1 
+            && fields.rule == RULE_TRAPEZOID) {
+        store_put(server->store, &key, integral);
+    }
+}
+
+/* Runs a job for the provided integration fields on the provided shard's 
+ * compute pool and waits for it to finish. If the client connected on fd 
+ * disconnects first, the job is cancelled. Either way this waits for every
+ * chunk to leave the pool before returning. 
+ *
+ * Returns RUN_REFUSED if the job could not be started, RUN_HUNG_UP if it 
+ * was cancelled and RUN_DONE otherwise, with the integral stored in result 
+ * and its standard error, for a quasi-Monte Carlo job, in error. 
+ */
+int run_integration(Shard* shard, Fields fields, int fd, double* result,
+        double* error) {
+    Job* job = start_job(shard, fields, NULL);
+    if (!job) {
+        return RUN_REFUSED;
+    }
+    bool completed = wait_for_job(job, fd);
+    uint64_t done;
+    read(job->doneFd, &done, sizeof(done));
+    *result = finish_job(shard, job, completed, error);
+    return completed ? RUN_DONE : RUN_HUNG_UP;
+}
+
+/* Writes the predicted cost of the provided integration fields on the 
+ * provided shard to the provided buffer as a JSON object. 
+ */
+void render_estimate(Shard* shard, Fields fields, char* buffer) {
+    Estimate estimate = estimate_job(shard->server, &shard->pool, fields);
+    sprintf(buffer, "{\"nodes\":%d,\"units_per_eval\":%g,"
+            "\"predicted_seconds\":%g,\"class\":\"%s\"}\n", 
+            estimate.nodes, estimate.units, estimate.seconds, 
+            classNames[estimate.priority]);
+}
+
+/* Admits a job costing the provided number of segments if the admitted but
+ * unfinished work plus this job fits within the server's limit. A job is
+ * always admitted when nothing else is pending so any single valid job can
+ * run. 
+ *
+ * Returns true if the job was admitted, false if it should be shed. 
+ */
+bool admit(Server* server, long cost) {
+    long pending = __atomic_load_n(&server->pendingSegs, __ATOMIC_RELAXED);
+    do {
+        if (pending > 0 && pending + cost > server->maxPending) {
+            __atomic_add_fetch(&server->shed, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&server->pendingSegs, &pending, 
+            pending + cost, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+/* Returns the provided number of segments of an admitted job that has 
+ * finished or been cancelled. 
+ */
+void release(Server* server, long cost) {
+    __atomic_sub_fetch(&server->pendingSegs, cost, __ATOMIC_RELAXED);
+}
+
+/* Estimates how long a shed client should wait before retrying, based on
+ * how long the pool would take to get through the currently pending work. 
+ *
+ * Returns the number of seconds to wait, between 1 and MAX_RETRY_AFTER. 
+ */
+long retry_after(Server* server) {
+    long pending = __atomic_load_n(&server->pendingSegs, __ATOMIC_RELAXED);
+    long wait = 1 + pending 
+            / ((long)server->numWorkers * SEGS_PER_WORKER_SEC);
+    return wait < MAX_RETRY_AFTER ? wait : MAX_RETRY_AFTER;
+}
+
+/* Renders the server's counters for a /stats request in the format selected
+ * by the provided address: Prometheus text if it asks for 
+ * "format=prometheus", JSON otherwise. Sets contentType to the matching
+ * media type. 
+ *
+ * Returns the dynamically allocated body generated. 
+ */
+char* render_stats(Server* server, char* address, char** contentType) {
+    StatsGauges gauges;
+    gauges.activeConnections = 
+            __atomic_load_n(&server->activeConnections, __ATOMIC_RELAXED);
+    gauges.poolWorkers = server->numWorkers;
+    gauges.queueDepth = 0;
+    for (int i = 0; i < server->numShards; i++) {
+        gauges.queueDepth += __atomic_load_n(&server->shards[i].pool.depth, 
+                __ATOMIC_RELAXED);
+    }
+    gauges.cancelled = __atomic_load_n(&server->cancelled, __ATOMIC_RELAXED);
+    gauges.pendingSegs = __atomic_load_n(&server->pendingSegs, 
+            __ATOMIC_RELAXED);
+    gauges.maxPending = server->maxPending;
+    gauges.shed = __atomic_load_n(&server->shed, __ATOMIC_RELAXED);
+
+    char* body = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&body, &size);
+    if (strstr(address, "format=prometheus")) {
+        stats_write_prometheus(out, &gauges);
+        *contentType = "text/plain; version=0.0.4";
+    } else {
+        stats_write_json(out, &gauges);
+        *contentType = "application/json";
+    }
+    fclose(out);
+    return body;
+}
+
+/* Renders the spans recorded for sampled requests for a /trace request as
+ * Chrome trace event JSON. 
+ *
+ * Returns the dynamically allocated body generated. 
+ */
+char* render_trace(void) {
+    char* body = NULL;
+    size_t size = 0;
+    FILE* out = open_memstream(&body, &size);
+    trace_write_json(out);
+    fclose(out);
+    return body;
+}
+
+/* Maps the provided request type returned by check_type to the kind it is
+ * counted as. 
+ *
+ * Returns the RequestKind for type. 
+ */
+RequestKind kind_of(int type) {
+    switch (type) {
+        case VALIDATE:
+            return KIND_VALIDATE;
+        case INTEGRATE:
+            return KIND_INTEGRATE;
+        case STATS:
+            return KIND_STATS;
+        case ESTIMATE:
+            return KIND_ESTIMATE;
+    }
+    return KIND_OTHER;
+}
+
+/* Adds the provided header to those sent with the exchange's response. 
+ */
+void add_header(Exchange* ex, char* name, char* value) {
+    HttpHeader* header = &ex->header[ex->numHeaders];
+    header->name = name;
+    header->value = value;
+    ex->headerList[ex->numHeaders++] = header;
+    ex->headerList[ex->numHeaders] = NULL;
+    ex->headers = ex->headerList;
+}
+
+/* Finds which protocol the provided request headers ask to switch the 
+ * connection to. 
+ *
+ * Returns UPGRADE_BINARY or UPGRADE_SHM for the protocol's Upgrade token, 
+ * NO_UPGRADE if there is no Upgrade header or the token is unknown. 
+ */
+int wanted_upgrade(HttpHeader** headers) {
+    for (int i = 0; headers && headers[i]; i++) {
+        if (strcasecmp(headers[i]->name, "Upgrade")) {
+            continue;
+        }
+        if (!strcasecmp(headers[i]->value, BINARY_PROTOCOL)) {
+            return UPGRADE_BINARY;
+        } else if (!strcasecmp(headers[i]->value, SHM_PROTOCOL)) {
+            return UPGRADE_SHM;
+        }
+    }
+    return NO_UPGRADE;
+}
+
+/* Makes the response of the provided exchange 503 Service Unavailable, 
+ * telling the client when to retry. 
+ */
+void refuse_exchange(Server* server, Exchange* ex) {
+    sprintf(ex->value, "%ld", retry_after(server));
+    add_header(ex, "Retry-After", ex->value);
+    ex->stat = 503;
+    ex->expl = "Service Unavailable";
+}
+
+/* Starts serving the provided complete HTTP request, which arrived at start
+ * and is owned by the exchange from now on. Every request except an 
+ * admitted /integrate/ request is answered straight away, including an 
+ * integration whose result is in the result store; an admitted integration
+ * leaves its parsed fields in the exchange for the caller to 
+ * run. A request to switch to another protocol is answered with 101 
+ * Switching Protocols if the protocol is no later than maxUpgrade in 
+ * NO_UPGRADE, UPGRADE_BINARY, UPGRADE_SHM order, and refused otherwise so
+ * the client carries on with HTTP. 
+ *
+ * Returns true if the exchange is an admitted integration still to be run,
+ * false if its response is ready. 
+ */
+bool begin_exchange(Shard* shard, Exchange* ex, char* request, 
+        uint64_t start, int maxUpgrade) {
+    Server* server = shard->server;
+    uint64_t parsed = stats_now();
+    stats_record_phase(PHASE_READ, parsed - start);
+    memset(ex, 0, sizeof(Exchange));
+    ex->start = start;
+    ex->request = request;
+    ex->traceId = trace_begin();
+    trace_span(ex->traceId, "read_request", start, parsed, TRACE_NO_ARG);
+    int numRead = parse_HTTP_request(request, strlen(request), 
+            &ex->method, &ex->address, &ex->reqHeaders, &ex->reqBody);
+    ex->type = check_type(numRead, ex->method, ex->address);
+    uint64_t checked = stats_now();
+    stats_record_phase(PHASE_PARSE, checked - parsed);
+    trace_span(ex->traceId, "parse_HTTP_request", parsed, checked, 
+            TRACE_NO_ARG);
+    if (ex->type == VALIDATE) {
+        if (check_func(ex->address)) {
+            ex->stat = 200;
+            ex->expl = "OK";
+        } 
+    } else if (ex->type == INTEGRATE) {
+        double integral;
+        if (check_integrate(ex->address)) {
+            ex->fields = get_fields(ex->address, ex->buffer);
+            if (recall(server, ex->fields, &integral)) {
+                sprintf(ex->result, "%.17g\n", integral);
+                ex->body = ex->result;
+                ex->stat = 200;
+                ex->expl = "OK";
+            } else if (admit(server, job_segments(ex->fields))) {
+                return true;
+            } else {
+                refuse_exchange(server, ex);
+            }
+        } 
+    } else if (ex->type == ESTIMATE) {
+        if (check_integrate(ex->address)) {
+            render_estimate(shard, get_fields(ex->address, ex->buffer), 
+                    ex->result);
+            add_header(ex, "Content-Type", "application/json");
+            ex->body = ex->result;
+            ex->stat = 200;
+            ex->expl = "OK";
+        }
+    } else if (ex->type == STATS) {
+        char* contentType;
+        ex->stats = render_stats(server, ex->address, &contentType);
+        add_header(ex, "Content-Type", contentType);
+        ex->body = ex->stats;
+        ex->stat = 200;
+        ex->expl = "OK";
+    } else if (ex->type == TRACE && trace_enabled()) {
+        ex->trace = render_trace();
+        add_header(ex, "Content-Type", "application/json");
+        ex->body = ex->trace;
+        ex->stat = 200;
+        ex->expl = "OK";
+    } else if (ex->type == BINARY) {
+        int upgrade = wanted_upgrade(ex->reqHeaders);
+        if (upgrade != NO_UPGRADE && upgrade <= maxUpgrade) {
+            add_header(ex, "Upgrade", upgrade == UPGRADE_SHM 
+                    ? SHM_PROTOCOL : BINARY_PROTOCOL);
+            add_header(ex, "Connection", "Upgrade");
+            ex->upgrade = upgrade;
+            ex->stat = 101;
+            ex->expl = "Switching Protocols";
+        }
+    }
+    if (ex->stat == 0) {
+        ex->stat = 400;
+        ex->expl = "Bad Request";
+    }
+    return false;
+}
+
+/* Releases the admitted integration of the provided exchange, which could 
+ * not be started, and refuses it. 
+ */
+void abandon_integration(Server* server, Exchange* ex) {
+    release(server, job_segments(ex->fields));
+    refuse_exchange(server, ex);
+}
+
+/* Releases the admitted integration of the provided exchange and makes the
+ * provided integral its response. A quasi-Monte Carlo integral's standard 
+ * error, left in the exchange, is sent in an X-Standard-Error header. 
+ */
+void finish_integration(Server* server, Exchange* ex, double integral) {
+    release(server, job_segments(ex->fields));
+    if (ex->fields.rule == RULE_QMC) {
+        sprintf(ex->value, "%.17g", ex->error);
+        add_header(ex, "X-Standard-Error", ex->value);
+    }
+    sprintf(ex->result, "%.17g\n", integral);
+    ex->body = ex->result;
+    ex->stat = 200;
+    ex->expl = "OK";
+}
+
+/* Ends the admitted integration of the provided exchange, which ran with 
+ * the provided outcome, and makes its response. A result that was 
+ * coordinated is not stored, as it depends on how the range was split 
+ * between peers and only results of the same bits are stored. 
+ */
+void end_integration(Server* server, Exchange* ex, int outcome, 
+        double integral, bool coordinated) {
+    if (outcome == RUN_DONE && !coordinated) {
+        remember(server, ex->fields, integral);
+    }
+    if (outcome == RUN_REFUSED) {
+        abandon_integration(server, ex);
+    } else {
+        finish_integration(server, ex, integral);
+    }
+}
+
+/* Returns the dynamically allocated HTTP response of the provided exchange.
+ */
+char* build_response(Exchange* ex) {
+    return construct_HTTP_response(ex->stat, ex->expl, ex->headers, ex->body);
+}
+
+/* Counts and times the provided exchange once its response, which started
+ * being written at written, has been sent. 
+ */
+void record_exchange(Exchange* ex, uint64_t written) {
+    uint64_t end = stats_now();
+    stats_record_phase(PHASE_WRITE, end - written);
+    stats_record_request(kind_of(ex->type), ex->stat, end - ex->start);
+    trace_span(ex->traceId, "write_response", written, end, TRACE_NO_ARG);
+    trace_span(ex->traceId, "request", ex->start, end, TRACE_NO_ARG);
+}
+
+/* Frees everything owned by the provided exchange. 
+ */
+void free_exchange(Exchange* ex) {
+    free(ex->stats);
+    free(ex->trace);
+    free(ex->request);
+    free(ex->method);
+    free(ex->address);
+    free(ex->reqBody);
+    if (ex->reqHeaders) {
+        free_array_of_headers(ex->reqHeaders);
+    }
+}
+
+/* Starts connecting to the provided peer, whose address has been resolved,
+ * without waiting for the connection to be made. 
+ *
+ * Returns the socket, or -1 if the connection failed straight away. 
+ */
+int start_connect(Peer* peer) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&peer->addr, 
+            sizeof(struct sockaddr_in)) && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Connects to the provided peer, resolving its address the first time, 
+ * giving up after PEER_TIMEOUT_MS. Only the probe thread calls this, as it
+ * blocks. 
+ *
+ * Returns the connected socket, or -1 if the peer cannot be reached. 
+ */
+int connect_peer(Peer* peer) {
+    if (!peer->resolved) {
+        struct addrinfo* ai = NULL;
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(peer->host, peer->port, &hints, &ai)) {
+            return -1;
+        }
+        memcpy(&peer->addr, ai->ai_addr, sizeof(struct sockaddr_in));
+        freeaddrinfo(ai);
+        peer->resolved = true;
+    }
+    int fd = start_connect(peer);
+    if (fd < 0) {
+        return -1;
+    }
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    int err;
+    socklen_t len = sizeof(err);
+    if (poll(&pfd, 1, PEER_TIMEOUT_MS) != 1 
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Sends a GET request for the provided address on the connection fd. 
+ *
+ * Returns false if it could not be sent, true otherwise. 
+ */
+bool send_get(int fd, char* address) {
+    char request[MAX_LINE * 2];
+    int len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\n\r\n",
+            address);
+    return len < sizeof(request) 
+            && send(fd, request, len, MSG_NOSIGNAL) == len;
+}
+
+/* Marks the provided peer as failed so it is not used, and its capacity is
+ * asked for again, once PEER_RETRY_NS has passed. 
+ */
+void mark_down(Peer* peer) {
+    __atomic_store_n(&peer->capacity, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&peer->downUntil, stats_now() + PEER_RETRY_NS, 
+            __ATOMIC_RELAXED);
+}
+
+/* Asks the provided peer for its /stats and records the number of compute 
+ * threads it advertises as its capacity. A peer that cannot be asked is 
+ * marked down. 
+ */
+void probe_peer(Peer* peer) {
+    int capacity = 0;
+    int fd = connect_peer(peer);
+    if (fd >= 0 && send_get(fd, "/stats")) {
+        char* in = NULL;
+        int inLen = 0;
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        char buffer[MAX_LINE];
+        int n;
+        while (message_length(in, inLen) == 0 
+                && poll(&pfd, 1, PEER_TIMEOUT_MS) == 1
+                && (n = read(fd, buffer, sizeof(buffer))) > 0) {
+            in = realloc(in, inLen + n + 1);
+            memcpy(in + inLen, buffer, n);
+            inLen += n;
+            in[inLen] = '\0';
+        }
+        char* workers = in && message_length(in, inLen) > 0 
+                ? strstr(in, "\"pool_workers\":") : NULL;
+        if (workers) {
+            capacity = atoi(workers + strlen("\"pool_workers\":"));
+        }
+        free(in);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (capacity > 0) {
+        __atomic_store_n(&peer->capacity, capacity, __ATOMIC_RELEASE);
+    } else {
+        mark_down(peer);
+    }
+}
+
+/* Asks each of the provided server's peers for its capacity whenever that 
+ * is not known and the peer is not down, every PROBE_CHECK_MS. Peers are 
+ * asked on this thread so that neither starting up nor a coordination 
+ * waits on one; until a peer has answered it is simply not used. 
+ */
+void* probe_thread(void* arg) {
+    Server* server = (Server*)arg;
+    while (true) {
+        for (int i = 0; i < server->numPeers; i++) {
+            Peer* peer = &server->peers[i];
+            if (!__atomic_load_n(&peer->capacity, __ATOMIC_RELAXED) 
+                    && stats_now() >= __atomic_load_n(&peer->downUntil, 
+                    __ATOMIC_RELAXED)) {
+                probe_peer(peer);
+            }
+        }
+        poll(NULL, 0, PROBE_CHECK_MS);
+    }
+    return NULL;
+}
+
+/* Checks if the provided peer can be given work: its capacity is known and
+ * it is not down. 
+ *
+ * Returns true if it can, false otherwise. 
+ */
+bool peer_available(Peer* peer) {
+    return stats_now() >= __atomic_load_n(&peer->downUntil, __ATOMIC_RELAXED)
+            && __atomic_load_n(&peer->capacity, __ATOMIC_ACQUIRE) > 0;
+}
+
+/* Adds a piece covering seg segments of the provided integration starting
+ * at segment start, meant for the provided peer. 
+ */
+void add_piece(Coordination* c, Fields fields, int start, int seg, int thr,
+        int peer) {
+    double h = (fields.up - fields.low) / fields.seg;
+    Piece* piece = &c->pieces[c->numPieces++];
+    piece->fields = fields;
+    piece->fields.low = fields.low + start * h;
+    piece->fields.up = start + seg == fields.seg 
+            ? fields.up : fields.low + (start + seg) * h;
+    piece->fields.seg = seg;
+    piece->fields.thr = thr;
+    piece->peer = peer;
+    piece->done = false;
+    c->remaining++;
+}
+
+/* Splits the provided integration into one piece per available peer, sized
+ * in proportion to the peer's advertised capacity and rounded down to a 
+ * multiple of it. Segments left over go in a final piece for the local 
+ * pool. Because the trapezoidal rule is additive over adjacent segments 
+ * with the same spacing, the pieces' integrals sum to the whole. 
+ */
+void split_range(Server* server, Fields fields, Coordination* c) {
+    int* capacities = calloc(server->numPeers, sizeof(int));
+    long total = 0;
+    for (int i = 0; i < server->numPeers; i++) {
+        if (peer_available(&server->peers[i])) {
+            capacities[i] = __atomic_load_n(&server->peers[i].capacity, 
+                    __ATOMIC_RELAXED);
+            total += capacities[i];
+        }
+    }
+    c->pieces = calloc(server->numPeers + 1, sizeof(Piece));
+    int start = 0;
+    for (int i = 0; i < server->numPeers; i++) {
+        if (!capacities[i]) {
+            continue;
+        }
+        int seg = (int)((double)fields.seg * capacities[i] / total) 
+                / capacities[i] * capacities[i];
+        if (seg > 0) {
+            add_piece(c, fields, start, seg, capacities[i], i);
+            start += seg;
+        }
+    }
+    if (start < fields.seg) {
+        int seg = fields.seg - start;
+        add_piece(c, fields, start, seg, divisor_at_most(seg, fields.thr), 
+                LOCAL_PIECE);
+    }
+    free(capacities);
+}
+
+/* Starts an attempt at the piece with the provided index on the provided 
+ * peer as an ordinary /integrate/ request, or on the local pool if peer is
+ * LOCAL_PIECE. The connection to a peer is only started here; the request
+ * is sent once it is made. A peer whose connection fails straight away is
+ * marked down. A peer is given until a deadline set from the piece's 
+ * estimated run time to connect and answer. 
+ *
+ * Returns false if the peer could not be given the piece, true otherwise. 
+ */
+bool dispatch(Shard* shard, Coordination* c, int index, int peer) {
+    Attempt attempt;
+    memset(&attempt, 0, sizeof(Attempt));
+    attempt.piece = index;
+    attempt.peer = peer;
+    attempt.fd = -1;
+    attempt.sent = stats_now();
+    Fields fields = c->pieces[index].fields;
+    if (peer == LOCAL_PIECE) {
+        attempt.job = start_job(shard, fields, NULL);
+        if (!attempt.job) {
+            return false;
+        }
+    } else {
+        Peer* target = &shard->server->peers[peer];
+        int capacity = __atomic_load_n(&target->capacity, __ATOMIC_RELAXED);
+        attempt.fd = start_connect(target);
+        if (attempt.fd < 0) {
+            mark_down(target);
+            return false;
+        }
+        fields.thr = divisor_at_most(fields.seg, capacity);
+        char address[MAX_LINE * 2];
+        snprintf(address, sizeof(address), "/integrate/%s/%.17g/%.17g/%d/%d",
+                fields.func, fields.low, fields.up, fields.seg, fields.thr);
+        attempt.address = strdup(address);
+        attempt.connecting = true;
+        Estimate estimate = estimate_job(shard->server, &shard->pool, fields);
+        attempt.deadline = stats_now() + PEER_TIMEOUT_MS * 1000000ULL 
+                + (uint64_t)(DEADLINE_FACTOR * estimate.seconds * 1e9);
+    }
+    c->attempts = realloc(c->attempts, 
+            sizeof(Attempt) * (c->numAttempts + 1));
+    c->attempts[c->numAttempts++] = attempt;
+    return true;
+}
+
+/* Starts the piece with the provided index on the first available peer 
+ * other than exclude, trying the peer it was meant for first, or on the 
+ * local pool if no peer takes it. Pieces meant for the local pool stay 
+ * there. If the local pool cannot take it either, the coordination fails.
+ */
+void place(Shard* shard, Coordination* c, int index, int exclude) {
+    Server* server = shard->server;
+    int first = c->pieces[index].peer;
+    for (int k = 0; first != LOCAL_PIECE && k < server->numPeers; k++) {
+        int peer = (first + k) % server->numPeers;
+        if (peer != exclude && peer_available(&server->peers[peer]) 
+                && dispatch(shard, c, index, peer)) {
+            return;
+        }
+    }
+    if (!dispatch(shard, c, index, LOCAL_PIECE)) {
+        c->failed = true;
+    }
+}
+
+/* Counts the live attempts at the piece with the provided index. 
+ *
+ * Returns the number of attempts. 
+ */
+int live_attempts(Coordination* c, int index) {
+    int count = 0;
+    for (int i = 0; i < c->numAttempts; i++) {
+        count += !c->attempts[i].dead && c->attempts[i].piece == index;
+    }
+    return count;
+}
+
+/* Closes the provided peer attempt's connection and frees what it holds.
+ * The connection is reset rather than shut down, since a peer takes a 
+ * client that only shuts down its side to still be waiting for the answer
+ * and would carry on integrating an abandoned piece. 
+ */
+void close_attempt(Attempt* attempt) {
+    if (attempt->fd >= 0) {
+        struct linger linger = {1, 0};
+        setsockopt(attempt->fd, SOL_SOCKET, SO_LINGER, &linger, 
+                sizeof(linger));
+        close(attempt->fd);
+    }
+    free(attempt->in);
+    free(attempt->address);
+}
+
+/* Ends the attempt with the provided index. If it succeeded its piece is 
+ * done, unless another attempt finished it first, and any other attempt at
+ * the piece is abandoned, which cancels it on its peer. If it failed and 
+ * nothing else is working on the piece, the piece is started elsewhere. 
+ */
+void end_attempt(Shard* shard, Coordination* c, int index, bool ok, 
+        double result) {
+    Attempt* attempt = &c->attempts[index];
+    attempt->dead = true;
+    close_attempt(attempt);
+    int peer = attempt->peer;
+    Piece* piece = &c->pieces[attempt->piece];
+    if (ok && !piece->done) {
+        piece->done = true;
+        piece->result = result;
+        c->remaining--;
+        uint64_t took = stats_now() - attempt->sent;
+        if (peer != LOCAL_PIECE && (!c->fastestNs || took < c->fastestNs)) {
+            c->fastestNs = took;
+        }
+        for (int i = 0; i < c->numAttempts; i++) {
+            Attempt* other = &c->attempts[i];
+            if (!other->dead && other->piece == attempt->piece) {
+                other->dead = true;
+                close_attempt(other);
+            }
+        }
+    } else if (!ok && !piece->done && !live_attempts(c, attempt->piece)) {
+        place(shard, c, attempt->piece, peer);
+    }
+}
+
+/* Finishes connecting the live attempt with the provided index to its peer
+ * and sends the peer its request. A peer that cannot be reached is marked 
+ * down and the attempt fails. 
+ */
+void finish_connect(Shard* shard, Coordination* c, int index) {
+    Attempt* attempt = &c->attempts[index];
+    int err;
+    socklen_t len = sizeof(err);
+    if (getsockopt(attempt->fd, SOL_SOCKET, SO_ERROR, &err, &len) || err 
+            || !send_get(attempt->fd, attempt->address)) {
+        mark_down(&shard->server->peers[attempt->peer]);
+        end_attempt(shard, c, index, false, 0);
+        return;
+    }
+    attempt->connecting = false;
+}
+
+/* Collects what is ready for the live attempt with the provided index: the
+ * result of a local job, its peer's connection being made, or more of a 
+ * peer's response. A peer that hangs up or answers with anything but a 
+ * result is marked down. 
+ */
+void collect(Shard* shard, Coordination* c, int index) {
+    Attempt* attempt = &c->attempts[index];
+    if (attempt->connecting) {
+        finish_connect(shard, c, index);
+        return;
+    }
+    if (attempt->job) {
+        uint64_t done;
+        read(attempt->job->doneFd, &done, sizeof(done));
+        double result = finish_job(shard, attempt->job, true, NULL);
+        attempt->job = NULL;
+        end_attempt(shard, c, index, true, result);
+        return;
+    }
+    char buffer[MAX_LINE];
+    int n = read(attempt->fd, buffer, sizeof(buffer));
+    int len = 0;
+    if (n > 0) {
+        attempt->in = realloc(attempt->in, attempt->inLen + n + 1);
+        memcpy(attempt->in + attempt->inLen, buffer, n);
+        attempt->inLen += n;
+        attempt->in[attempt->inLen] = '\0';
+        len = message_length(attempt->in, attempt->inLen);
+        if (len == 0) {
+            return;
+        }
+    }
+    int stat = 0;
+    double result = 0;
+    if (len > 0) {
+        char* expl = NULL;
+        HttpHeader** headers = NULL;
+        char* body = NULL;
+        if (parse_HTTP_response(attempt->in, len, &stat, &expl, &headers, 
+                &body) && stat == 200 && body) {
+            sscanf(body, "%lf", &result);
+        }
+        free(expl);
+        free(body);
+        if (headers) {
+            free_array_of_headers(headers);
+        }
+    }
+    if (stat != 200) {
+        mark_down(&shard->server->peers[attempt->peer]);
+    }
+    end_attempt(shard, c, index, stat == 200, result);
+}
+
+/* Sends each piece a peer has been working on for more than SLOW_FACTOR 
+ * times as long as the fastest finished piece to an idle available peer as
+ * well. Whichever attempt finishes first is used. 
+ */
+void hedge(Shard* shard, Coordination* c) {
+    Server* server = shard->server;
+    uint64_t now = stats_now();
+    int count = c->numAttempts;
+    for (int i = 0; i < count; i++) {
+        Attempt attempt = c->attempts[i];
+        if (attempt.dead || attempt.peer == LOCAL_PIECE 
+                || now - attempt.sent <= SLOW_FACTOR * c->fastestNs
+                || live_attempts(c, attempt.piece) > 1) {
+            continue;
+        }
+        for (int peer = 0; peer < server->numPeers; peer++) {
+            bool idle = true;
+            for (int j = 0; j < c->numAttempts; j++) {
+                idle &= c->attempts[j].dead || c->attempts[j].peer != peer;
+            }
+            if (idle && peer_available(&server->peers[peer]) 
+                    && dispatch(shard, c, attempt.piece, peer)) {
+                break;
+            }
+        }
+    }
+}
+
+/* Fails every live peer attempt of the provided coordination whose peer has
+ * not answered by its deadline, marking the peer down so the piece is sent
+ * elsewhere. 
+ */
+void expire(Shard* shard, Coordination* c) {
+    uint64_t now = stats_now();
+    int count = c->numAttempts;
+    for (int i = 0; i < count; i++) {
+        Attempt* attempt = &c->attempts[i];
+        if (!attempt->dead && attempt->peer != LOCAL_PIECE 
+                && now >= attempt->deadline) {
+            mark_down(&shard->server->peers[attempt->peer]);
+            end_attempt(shard, c, i, false, 0);
+        }
+    }
+}
+
+/* Works out how long the provided coordination may wait for its attempts
+ * before it next has to expire or hedge any. 
+ *
+ * Returns the time to wait in milliseconds, or -1 to wait indefinitely. 
+ */
+int wait_ms(Coordination* c) {
+    uint64_t now = stats_now();
+    long wait = c->fastestNs ? HEDGE_CHECK_MS : -1;
+    for (int i = 0; i < c->numAttempts; i++) {
+        Attempt* attempt = &c->attempts[i];
+        if (attempt->dead || attempt->peer == LOCAL_PIECE) {
+            continue;
+        }
+        long left = attempt->deadline > now 
+                ? (attempt->deadline - now + 999999) / 1000000 : 0;
+        if (wait < 0 || left < wait) {
+            wait = left;
+        }
+    }
+    return wait;
+}
+
+/* Removes the dead attempts of the provided coordination. 
+ */
+void sweep(Coordination* c) {
+    int live = 0;
+    for (int i = 0; i < c->numAttempts; i++) {
+        if (!c->attempts[i].dead) {
+            c->attempts[live++] = c->attempts[i];
+        }
+    }
+    c->numAttempts = live;
+}
+
+/* Checks if the provided integration is large enough, and of a kind, to be
+ * split between the server's peers. 
+ *
+ * Returns true if it is, false otherwise. 
+ */
+bool wants_coordination(Server* server, Fields fields) {
+    return server->numPeers && fields.dims == 1 
+            && fields.rule == RULE_TRAPEZOID 
+            && fields.seg >= COORDINATE_MIN_SEGS;
+}
+
+/* Integrates the provided fields across the server's peers: the range is 
+ * split into pieces sized to each peer's capacity, which are sent to the 
+ * peers as ordinary /integrate/ requests and their partial sums added up.
+ * A piece whose peer fails or misses its deadline is sent to another peer,
+ * or run locally if none is available, and a slow piece is also sent to an
+ * idle peer. The pieces are added in order, so unlike a local job the 
+ * result's last bits depend on how the range was split. If the client 
+ * connected on fd disconnects first, or a piece cannot be run anywhere, 
+ * every attempt is abandoned. 
+ *
+ * Returns RUN_HUNG_UP if the client disconnected, RUN_REFUSED if a piece 
+ * could not be run and RUN_DONE otherwise, with the integral stored in 
+ * result. 
+ */
+int coordinate(Shard* shard, Fields fields, int fd, double* result) {
+    Coordination c;
+    memset(&c, 0, sizeof(Coordination));
+    split_range(shard->server, fields, &c);
+    for (int i = 0; i < c.numPieces; i++) {
+        place(shard, &c, i, NO_PEER);
+    }
+
+    bool hungUp = false;
+    struct pollfd* fds = NULL;
+    while (c.remaining && !hungUp && !c.failed) {
+        fds = realloc(fds, sizeof(struct pollfd) * (c.numAttempts + 1));
+        fds[0].fd = fd;
+        fds[0].events = 0;
+        for (int i = 0; i < c.numAttempts; i++) {
+            Attempt* attempt = &c.attempts[i];
+            fds[i + 1].fd = attempt->job ? attempt->job->doneFd : attempt->fd;
+            fds[i + 1].events = attempt->connecting ? POLLOUT : POLLIN;
+        }
+        if (poll(fds, c.numAttempts + 1, wait_ms(&c)) < 0) {
+            continue;
+        }
+        hungUp = fds[0].revents & (POLLHUP | POLLERR);
+        int count = c.numAttempts;
+        for (int i = 0; i < count && !hungUp; i++) {
+            if (!c.attempts[i].dead && fds[i + 1].revents) {
+                collect(shard, &c, i);
+            }
+        }
+        if (!hungUp) {
+            expire(shard, &c);
+        }
+        if (c.fastestNs && !hungUp) {
+            hedge(shard, &c);
+        }
+        sweep(&c);
+    }
+    free(fds);
+
+    bool counted = false;
+    for (int i = 0; i < c.numAttempts; i++) {
+        Attempt* attempt = &c.attempts[i];
+        if (attempt->job) {
+            __atomic_store_n(&attempt->job->cancelled, 1, __ATOMIC_RELAXED);
+            uint64_t done;
+            read(attempt->job->doneFd, &done, sizeof(done));
+            finish_job(shard, attempt->job, false, NULL);
+            counted = true;
+        } else {
+            close_attempt(attempt);
+        }
+    }
+    if (hungUp && !counted) {
+        __atomic_add_fetch(&shard->server->cancelled, 1, __ATOMIC_RELAXED);
+    }
+    *result = 0;
+    for (int i = 0; i < c.numPieces; i++) {
+        *result += c.pieces[i].result;
+    }
+    free(c.pieces);
+    free(c.attempts);
+    if (hungUp) {
+        return RUN_HUNG_UP;
+    }
+    return c.failed ? RUN_REFUSED : RUN_DONE;
+}
+
+/* Sends a reply frame for the provided request ID to the session's client,
+ * encoding it straight into the shared region's reply ring if the session
+ * has one. The client never has more requests outstanding than the ring 
+ * holds replies, so a full ring only means the client is slow to consume; 
+ * the reply is dropped if the client goes away meanwhile. 
+ */
+void send_reply(Session* session, uint32_t id, int status, uint32_t aux, 
+        double result) {
+    Frame reply;
+    reply.type = FRAME_REPLY;
+    reply.id = id;
+    reply.status = status;
+    reply.aux = aux;
+    reply.result = result;
+    if (!session->shm) {
+        frame_write(session->to, &reply);
+        return;
+    }
+    ShmRegion* shm = session->shm;
+    char* space;
+    while (!(space = shm_reserve(&shm->replies, MAX_FRAME))) {
+        if (__atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        sched_yield();
+    }
+    shm_publish(&shm->replies, frame_encode(&reply, space));
+    shm_notify(&shm->client);
+}
+
+/* Handles an intern frame by checking its expression is a valid expression
+ * of x without spaces and, if so, giving it the session's next expression 
+ * ID, which is sent back in the reply. 
+ */
+void intern_expr(Session* session, Frame* frame) {
+    uint64_t start = stats_now();
+    uint64_t traceId = trace_begin();
+    int stat = 400;
+    uint32_t id = 0;
+    bool spaces = false;
+    for (int i = 0; i < strlen(frame->func); i++) {
+        spaces |= isspace(frame->func[i]) != 0;
+    }
+    if (!spaces && session->numFuncs < MAX_INTERNED 
+            && valid_func(frame->func, 1)) {
+        session->funcs = realloc(session->funcs, 
+                sizeof(char*) * (session->numFuncs + 1));
+        session->funcs[session->numFuncs] = strdup(frame->func);
+        id = session->numFuncs++;
+        stat = 200;
+    }
+    send_reply(session, frame->id, stat, id, 0);
+    uint64_t end = stats_now();
+    stats_record_request(KIND_VALIDATE, stat, end - start);
+    trace_span(traceId, "request", start, end, TRACE_NO_ARG);
+}
+
+/* Handles an integrate frame. The fields are checked as for /integrate/ and
+ * the job admitted, then started on the shard's pool without waiting for 
+ * it; invalid and shed requests and those whose result is in the result 
+ * store are answered straight away. So is any request beyond the 
+ * MAX_RUNNING the session may have running, or one whose job cannot be 
+ * started, which is refused with 503. 
+ */
+void start_integration(Shard* shard, Session* session, Frame* frame) {
+    Server* server = shard->server;
+    uint64_t start = stats_now();
+    trace_begin();
+    Fields fields;
+    fields.low = frame->low;
+    fields.up = frame->up;
+    fields.seg = frame->seg;
+    fields.thr = frame->thr;
+    fields.dims = 1;
+    fields.rule = RULE_TRAPEZOID;
+    if (frame->exprId >= session->numFuncs || frame->seg > INT_MAX 
+            || frame->thr > INT_MAX || !isfinite(frame->low) 
+            || !isfinite(frame->up) || frame->up > INT_MAX 
+            || !check_ranges(fields)) {
+        send_reply(session, frame->id, 400, 0, 0);
+        stats_record_request(KIND_INTEGRATE, 400, stats_now() - start);
+        return;
+    }
+    fields.func = session->funcs[frame->exprId];
+    double integral;
+    if (recall(server, fields, &integral)) {
+        send_reply(session, frame->id, 200, 0, integral);
+        stats_record_request(KIND_INTEGRATE, 200, stats_now() - start);
+        return;
+    }
+    Job* job = NULL;
+    if (session->numRunning < MAX_RUNNING && admit(server, fields.seg)
+            && !(job = start_job(shard, fields, 
+            session->shm ? &session->shm->server : NULL))) {
+        release(server, fields.seg);
+    }
+    if (!job) {
+        send_reply(session, frame->id, 503, retry_after(server), 0);
+        stats_record_request(KIND_INTEGRATE, 503, stats_now() - start);
+        return;
+    }
+    session->running = realloc(session->running, 
+            sizeof(Running) * (session->numRunning + 1));
+    Running* running = &session->running[session->numRunning++];
+    running->job = job;
+    running->id = frame->id;
+    running->start = start;
+}
+
+/* Collects the session's running integration at the provided index, which
+ * has finished, and replies with its result if the client is still 
+ * connected. 
+ */
+void finish_running(Shard* shard, Session* session, int index, 
+        bool completed) {
+    Running running = session->running[index];
+    session->running[index] = session->running[--session->numRunning];
+    Fields fields = running.job->fields;
+    uint64_t traceId = running.job->traceId;
+    double result = finish_job(shard, running.job, completed, NULL);
+    release(shard->server, fields.seg);
+    if (completed) {
+        remember(shard->server, fields, result);
+        send_reply(session, running.id, 200, 0, result);
+        uint64_t end = stats_now();
+        stats_record_request(KIND_INTEGRATE, 200, end - running.start);
+        trace_span(traceId, "request", running.start, end, TRACE_NO_ARG);
+    }
+}
+
+/* Handles the provided frame received by the session. 
+ */
+void handle_frame(Shard* shard, Session* session, Frame* frame) {
+    if (frame->type == FRAME_INTERN) {
+        intern_expr(session, frame);
+    } else if (frame->type == FRAME_INTEGRATE) {
+        start_integration(shard, session, frame);
+    } else {
+        send_reply(session, frame->id, 400, 0, 0);
+    }
+}
+
+/* Cancels every integration the session has running. 
+ */
+void cancel_running(Session* session) {
+    for (int i = 0; i < session->numRunning; i++) {
+        __atomic_store_n(&session->running[i].job->cancelled, 1, 
+                __ATOMIC_RELAXED);
+    }
+}
+
+/* Frees the provided session. 
+ */
+void free_session(Session* session) {
+    for (int i = 0; i < session->numFuncs; i++) {
+        free(session->funcs[i]);
+    }
+    free(session->funcs);
+    free(session->running);
+    free(session);
+}
+
+/* Reads whatever the client has sent on fd and handles each complete frame
+ * received. End of file sets the session's eof. 
+ *
+ * Returns false if the connection failed or the client sent a badly formed
+ * frame, true otherwise. 
+ */
+bool read_frames(Shard* shard, Session* session, int fd) {
+    int n = read(fd, session->in + session->inLen, 
+            MAX_FRAME - session->inLen);
+    if (n == 0) {
+        session->eof = true;
+        return session->inLen == 0;
+    }
+    if (n < 0) {
+        return false;
+    }
+    session->inLen += n;
+    int pos = 0;
+    int len;
+    Frame frame;
+    while ((len = frame_decode(session->in + pos, session->inLen - pos, 
+            &frame)) > 0) {
+        handle_frame(shard, session, &frame);
+        pos += len;
+    }
+    session->inLen -= pos;
+    memmove(session->in, session->in + pos, session->inLen);
+    return len == 0;
+}
+
+/* Serves a connection switched to binary frames on the provided socket fd
+ * until the client disconnects. Integrations run concurrently and each is
+ * answered as soon as it finishes, so replies may arrive in any order. 
+ * Replies are flushed once per wake-up, so a burst of requests is answered
+ * with few writes. A client that shuts down its side still gets the replies
+ * to what it sent, and the session ends once they are written. When the 
+ * connection fails or the client sends a badly formed frame, its running 
+ * integrations are cancelled and collected before returning. 
+ */
+void binary_session(Shard* shard, int fd, FILE* to) {
+    Session* session = calloc(1, sizeof(Session));
+    session->to = to;
+    struct pollfd* fds = NULL;
+    bool open = true;
+    while ((open && !session->eof) || session->numRunning) {
+        fds = realloc(fds, sizeof(struct pollfd) * (session->numRunning + 1));
+        fds[0].fd = open ? fd : -1;
+        fds[0].events = session->eof ? 0 : POLLIN;
+        for (int i = 0; i < session->numRunning; i++) {
+            fds[i + 1].fd = session->running[i].job->doneFd;
+            fds[i + 1].events = POLLIN;
+        }
+        if (poll(fds, session->numRunning + 1, -1) < 0) {
+            continue;
+        }
+        for (int i = session->numRunning - 1; i >= 0; i--) {
+            if (fds[i + 1].revents & POLLIN) {
+                uint64_t done;
+                read(session->running[i].job->doneFd, &done, sizeof(done));
+                finish_running(shard, session, i, open);
+            }
+        }
+        if (fds[0].revents 
+                && (session->eof || !read_frames(shard, session, fd))) {
+            open = false;
+            cancel_running(session);
+        }
+        fflush(to);
+    }
+    free_session(session);
+    free(fds);
+}
+
+/* Checks without blocking whether the client on the socket fd has hung up.
+ * A client that has only shut down its side may still be reading, so it 
+ * has not. 
+ *
+ * Returns true if it has, false otherwise. 
+ */
+bool hung_up(int fd) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = 0;
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR));
+}
+
+/* Serves a local connection switched to shared memory on the provided Unix
+ * domain socket fd. The client passes the region over the socket, then 
+ * frames are decoded straight from its request ring and replies encoded 
+ * straight into its reply ring, with no system calls while both sides are
+ * busy. The session sleeps on the region's server futex, which the client 
+ * bumps for each request and finishing jobs bump too. The client going away
+ * is noticed from the region's closed flag or, if it exits without setting
+ * it, from the socket within HANGUP_CHECK_MS. A job still notifying the
+ * session keeps it spinning, so the region is never unmapped while a 
+ * worker may touch it. 
+ */
+void shm_session(Shard* shard, int fd) {
+    int shmFd = shm_recv_fd(fd);
+    ShmRegion* shm = shmFd < 0 ? NULL : shm_map(shmFd);
+    if (shmFd >= 0) {
+        close(shmFd);
+    }
+    if (!shm) {
+        return;
+    }
+    Session* session = calloc(1, sizeof(Session));
+    session->shm = shm;
+    bool open = true;
+    while (open || session->numRunning) {
+        uint32_t seen = __atomic_load_n(&shm->server.seq, __ATOMIC_ACQUIRE);
+        bool busy = false;
+        const char* data;
+        int avail;
+        while (open && (data = shm_peek(&shm->requests, &avail))) {
+            Frame frame;
+            int len = frame_decode(data, avail, &frame);
+            if (len <= 0) {
+                open = false;
+                cancel_running(session);
+                break;
+            }
+            handle_frame(shard, session, &frame);
+            shm_consume(&shm->requests, len);
+            busy = true;
+        }
+        for (int i = session->numRunning - 1; i >= 0; i--) {
+            int finished = __atomic_load_n(&session->running[i].job->finished,
+                    __ATOMIC_ACQUIRE);
+            if (finished == JOB_RELEASED) {
+                finish_running(shard, session, i, open);
+            }
+            busy |= finished != 0;
+        }
+        if (open && __atomic_load_n(&shm->closed, __ATOMIC_ACQUIRE)) {
+            open = false;
+            cancel_running(session);
+        } else if (!busy && !shm_wait(&shm->server, seen, HANGUP_CHECK_MS) 
+                && open && hung_up(fd)) {
+            open = false;
+            cancel_running(session);
+        }
+    }
+    free_session(session);
+    shm_unmap(shm);
+}
+
+/* Creates a duplicate file descriptor from the provided fd and opens a 
+ * reading and writng end to communicate with the client. Reads a request from
+ * the client and responds appropriately based on the request contents. This 
+ * loops until client is dead. Each request is counted and timed. 
+ */
+void* client_thread(void* arg) {
+    ClientArgs* clientArgs = (ClientArgs*)arg;
+    int fd = clientArgs->fd;
+    bool local = clientArgs->local;
+    Shard* shard = clientArgs->shard;
+    Server* server = shard->server;
+    free(arg);
+    int fd2 = dup(fd);
+    FILE* to = fdopen(fd, "w");
+    FILE* from = fdopen(fd2, "r");
+    __atomic_add_fetch(&server->activeConnections, 1, __ATOMIC_RELAXED);
+
+    while (true) {
+        uint64_t start;
+        char* request = read_request(from, &start);
+        if (request == NULL) {
+            break;
+        }
+        Exchange ex;
+        bool hungUp = false;
+        if (begin_exchange(shard, &ex, request, start, 
+                local ? UPGRADE_SHM : UPGRADE_BINARY)) {
+            double integral;
+            bool coordinated = wants_coordination(server, ex.fields);
+            int outcome = coordinated 
+                    ? coordinate(shard, ex.fields, fd, &integral)
+                    : run_integration(shard, ex.fields, fd, &integral, 
+                    &ex.error);
+            hungUp = outcome == RUN_HUNG_UP;
+            end_integration(server, &ex, outcome, integral, coordinated);
+        }
+        if (!hungUp) {
+            uint64_t written = stats_now();
+            char* response = build_response(&ex);
+            fputs(response, to);
+            fflush(to);
+            free(response);
+            record_exchange(&ex, written);
+        }
+        free_exchange(&ex);
+        if (hungUp) {
+            break;
+        }
+        if (ex.upgrade == UPGRADE_BINARY) {
+            binary_session(shard, fileno(from), to);
+            break;
+        } else if (ex.upgrade == UPGRADE_SHM) {
+            shm_session(shard, fileno(from));
+            break;
+        }
+    }
+    __atomic_sub_fetch(&server->activeConnections, 1, __ATOMIC_RELAXED);
+    fclose(to);
+    fclose(from);
+    return NULL;
+}
+
+/* Starts a detached thread running the provided function with arg, only on
+ * the provided shard's CPUs if it is pinned. 
+ */
+void start_thread(Shard* shard, void* (*run)(void*), void* arg) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (shard->pinned) {
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &shard->cpus);
+    }
+    pthread_t threadId;
+    pthread_create(&threadId, &attr, run, arg);
+    pthread_attr_destroy(&attr);
+}
+
+/* Serves a connection the io_uring backend has switched to binary frames 
+ * with the same session as a client thread, then closes it. 
+ */
+void* binary_thread(void* arg) {
+    ClientArgs* clientArgs = (ClientArgs*)arg;
+    int fd = clientArgs->fd;
+    Shard* shard = clientArgs->shard;
+    free(arg);
+    FILE* to = fdopen(fd, "w");
+    binary_session(shard, fd, to);
+    __atomic_sub_fetch(&shard->server->activeConnections, 1, 
+            __ATOMIC_RELAXED);
+    fclose(to);
+    return NULL;
+}
+
+/* Runs the coordinated integration of the provided io_uring backend 
+ * connection, which waits on peers for as long as it takes and so cannot 
+ * run on the ring's thread, then signals the connection's coordFd. The 
+ * client hanging up, or the connection being closed, ends it early. 
+ */
+void* coordinate_thread(void* arg) {
+    UringConn* conn = (UringConn*)arg;
+    conn->outcome = coordinate(conn->shard, conn->ex->fields, conn->fd, 
+            &conn->integral);
+    uint64_t done = 1;
+    write(conn->coordFd, &done, sizeof(done));
+    return NULL;
+}
+
+/* Closes the provided io_uring backend connection. Shutting the socket down
+ * ends its multishot receive and cancels any job it is waiting on; the 
+ * connection is freed by reap_conn once nothing refers to it. 
+ */
+void close_conn(UringConn* conn) {
+    if (!conn->closed) {
+        conn->closed = true;
+        shutdown(conn->fd, SHUT_RDWR);
+        if (conn->job) {
+            __atomic_store_n(&conn->job->cancelled, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Frees the provided io_uring backend connection if it is closed and no 
+ * operation in flight refers to it. 
+ */
+void reap_conn(Server* server, UringConn* conn) {
+    if (!conn->closed || conn->ops) {
+        return;
+    }
+    if (conn->ex) {
+        free_exchange(conn->ex);
+        free(conn->ex);
+    }
+    // A connection handed to a thread is counted and closed by the thread
+    if (conn->fd >= 0) {
+        __atomic_sub_fetch(&server->activeConnections, 1, __ATOMIC_RELAXED);
+        close(conn->fd);
+    }
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+/* Queues a send of the unsent part of the provided connection's response.
+ */
+void send_out(Uring* ring, UringConn* conn) {
+    uring_prep_send(uring_get_sqe(ring), conn->fd, conn->out + conn->outSent,
+            conn->outLen - conn->outSent, (uintptr_t)conn | OP_SEND);
+    conn->ops++;
+}
+
+/* Builds the response of the provided connection's current exchange and 
+ * queues it to be sent. 
+ */
+void respond(Uring* ring, UringConn* conn) {
+    conn->written = stats_now();
+    conn->out = build_response(conn->ex);
+    conn->outLen = strlen(conn->out);
+    conn->outSent = 0;
+    send_out(ring, conn);
+}
+
+/* Starts the coordinated integration of the provided connection's exchange
+ * on a thread of its own, with a read of the connection's coordFd queued.
+ */
+void start_coordination(Shard* shard, Uring* ring, UringConn* conn) {
+    conn->coordFd = eventfd(0, EFD_CLOEXEC);
+    if (conn->coordFd < 0) {
+        abandon_integration(shard->server, conn->ex);
+        respond(ring, conn);
+        return;
+    }
+    uring_prep_read(uring_get_sqe(ring), conn->coordFd, &conn->done,
+            sizeof(conn->done), (uintptr_t)conn | OP_DONE);
+    conn->ops++;
+    start_thread(shard, coordinate_thread, conn);
+}
+
+/* Answers the provided connection's request to switch to binary frames. 
+ * Its multishot receive is cancelled first, the answer only being sent 
+ * once the cancellation is done, so none of the frames the client sends 
+ * after seeing the answer are taken by the ring. 
+ */
+void start_upgrade(Uring* ring, UringConn* conn) {
+    conn->upgrading = true;
+    struct io_uring_sqe* sqe = uring_get_sqe(ring);
+    uring_prep_cancel(sqe, (uintptr_t)conn | OP_RECV, 
+            (uintptr_t)conn | OP_CANCEL);
+    sqe->flags |= IOSQE_IO_HARDLINK;
+    conn->ops++;
+    respond(ring, conn);
+}
+
+/* Hands the provided connection, whose switch to binary frames has been 
+ * answered, to a thread serving it as a client thread would. 
+ */
+void hand_off(Shard* shard, UringConn* conn) {
+    ClientArgs* clientArgs = malloc(sizeof(ClientArgs));
+    clientArgs->fd = conn->fd;
+    clientArgs->local = false;
+    clientArgs->shard = shard;
+    conn->fd = -1;
+    conn->closed = true;
+    start_thread(shard, binary_thread, clientArgs);
+}
+
+/* Starts serving the next request waiting in the provided connection's 
+ * input if it is idle. An admitted integration is handed to the shard's 
+ * pool with a read of its doneFd queued, or split between the server's 
+ * peers if it is large enough; a request to switch to binary frames is 
+ * answered and the connection handed off once it has been; anything else 
+ * is answered. A badly formed request closes the connection, as does 
+ * running out of requests once the client has shut down its side. 
+ */
+void serve_conn(Shard* shard, Uring* ring, UringConn* conn) {
+    if (conn->closed || conn->ex) {
+        return;
+    }
+    int len = message_length(conn->in, conn->inLen);
+    if (len < 0) {
+        close_conn(conn);
+        return;
+    }
+    if (len == 0) {
+        if (conn->eof) {
+            close_conn(conn);
+        }
+        return;
+    }
+    char* request = malloc(len + 1);
+    memcpy(request, conn->in, len);
+    request[len] = '\0';
+    conn->inLen -= len;
+    memmove(conn->in, conn->in + len, conn->inLen);
+    uint64_t start = conn->arrived;
+    conn->arrived = stats_now();
+
+    conn->ex = malloc(sizeof(Exchange));
+    if (begin_exchange(shard, conn->ex, request, start, UPGRADE_BINARY)) {
+        if (wants_coordination(shard->server, conn->ex->fields)) {
+            start_coordination(shard, ring, conn);
+            return;
+        }
+        conn->job = start_job(shard, conn->ex->fields, NULL);
+        if (!conn->job) {
+            abandon_integration(shard->server, conn->ex);
+            respond(ring, conn);
+            return;
+        }
+        uring_prep_read(uring_get_sqe(ring), conn->job->doneFd, &conn->done,
+                sizeof(conn->done), (uintptr_t)conn | OP_DONE);
+        conn->ops++;
+    } else if (conn->ex->upgrade == UPGRADE_BINARY) {
+        start_upgrade(ring, conn);
+    } else {
+        respond(ring, conn);
+    }
+}
+
+/* Handles a completion of the provided shard's multishot accept by starting
+ * a multishot receive on the accepted connection. The accept is rearmed if
+ * the kernel ended it. 
+ */
+void on_accept(Shard* shard, Uring* ring, struct io_uring_cqe* cqe) {
+    if (cqe->res >= 0) {
+        UringConn* conn = calloc(1, sizeof(UringConn));
+        conn->shard = shard;
+        conn->fd = cqe->res;
+        __atomic_add_fetch(&shard->server->activeConnections, 1, 
+                __ATOMIC_RELAXED);
+        uring_prep_recv(uring_get_sqe(ring), conn->fd, 
+                (uintptr_t)conn | OP_RECV);
+        conn->ops++;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_prep_accept(uring_get_sqe(ring), shard->serv, OP_ACCEPT);
+    }
+}
+
+/* Handles a completion of the provided connection's multishot receive. 
+ * Received data is appended to the connection's input and served. End of 
+ * file only means the client will send no more requests, so the one being
+ * served still gets its response and the connection is closed once it is 
+ * idle; an error closes it straight away, unless it is the receive being 
+ * cancelled for a switch to binary frames. The receive is rearmed if the 
+ * kernel ended it while the client may still send on the ring. 
+ */
+void on_recv(Shard* shard, Uring* ring, UringConn* conn, 
+        struct io_uring_cqe* cqe) {
+    if (cqe->res > 0) {
+        if (conn->inLen == 0) {
+            conn->arrived = stats_now();
+        }
+        conn->in = realloc(conn->in, conn->inLen + cqe->res);
+        memcpy(conn->in + conn->inLen, uring_buffer(ring, cqe), cqe->res);
+        conn->inLen += cqe->res;
+        uring_recycle(ring, cqe);
+        serve_conn(shard, ring, conn);
+    } else if (cqe->res == 0) {
+        conn->eof = true;
+        serve_conn(shard, ring, conn);
+    } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        close_conn(conn);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->ops--;
+        if (!conn->closed && !conn->eof && !conn->upgrading) {
+            uring_prep_recv(uring_get_sqe(ring), conn->fd, 
+                    (uintptr_t)conn | OP_RECV);
+            conn->ops++;
+        }
+    }
+}
+
+/* Handles a completed send of the provided connection's response. Once the
+ * whole response is sent the exchange is recorded and the next pipelined 
+ * request, if any, is served, or the connection handed off if it has 
+ * switched to binary frames. 
+ */
+void on_send(Shard* shard, Uring* ring, UringConn* conn, 
+        struct io_uring_cqe* cqe) {
+    conn->ops--;
+    if (cqe->res < 0) {
+        close_conn(conn);
+        return;
+    }
+    conn->outSent += cqe->res;
+    if (conn->outSent < conn->outLen) {
+        send_out(ring, conn);
+        return;
+    }
+    record_exchange(conn->ex, conn->written);
+    int upgrade = conn->ex->upgrade;
+    free_exchange(conn->ex);
+    free(conn->ex);
+    conn->ex = NULL;
+    free(conn->out);
+    conn->out = NULL;
+    if (upgrade == UPGRADE_BINARY) {
+        hand_off(shard, conn);
+    } else {
+        serve_conn(shard, ring, conn);
+    }
+}
+
+/* Handles the provided connection's integration finishing, either its job
+ * or its coordination. The job did not complete if the connection closed 
+ * while it ran; a coordination whose client hung up closes it. 
+ */
+void on_done(Shard* shard, Uring* ring, UringConn* conn) {
+    conn->ops--;
+    bool coordinated = !conn->job;
+    if (coordinated) {
+        close(conn->coordFd);
+        if (conn->outcome == RUN_HUNG_UP) {
+            close_conn(conn);
+        }
+    } else {
+        conn->outcome = conn->closed ? RUN_HUNG_UP : RUN_DONE;
+        conn->integral = finish_job(shard, conn->job, !conn->closed, 
+                &conn->ex->error);
+        conn->job = NULL;
+    }
+    end_integration(shard->server, conn->ex, conn->outcome, conn->integral,
+            coordinated);
+    if (!conn->closed) {
+        respond(ring, conn);
+    }
+}
+
+/* Serves every connection accepted on the provided shard's listening socket
+ * from one thread with an io_uring: a multishot accept takes connections, a
+ * multishot receive per connection reads requests into the ring's provided
+ * buffers and responses are sent through the ring, so a busy loop makes one
+ * system call per batch of completions. Integrations run on the shard's 
+ * pool as with the threads backend, with a read of each job's doneFd queued
+ * on the ring. What would block the ring, coordinating an integration 
+ * between peers or serving binary frames, is left to a thread of its own 
+ * running the threads backend's code. When the shard is pinned this thread,
+ * and so the threads it starts, only run on the shard's CPUs. 
+ */
+void* uring_thread(void* arg) {
+    Shard* shard = (Shard*)arg;
+    Server* server = shard->server;
+    if (shard->pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), 
+                &shard->cpus);
+    }
+    Uring ring;
+    if (!uring_init(&ring, URING_ENTRIES, URING_BUFS, URING_BUF_SIZE)) {
+        err_exit(LISTEN);
+    }
+    uring_prep_accept(uring_get_sqe(&ring), shard->serv, OP_ACCEPT);
+
+    while (true) {
+        uring_submit_and_wait(&ring, 1);
+        struct io_uring_cqe cqe;
+        while (uring_next_cqe(&ring, &cqe)) {
+            int op = cqe.user_data & OP_MASK;
+            UringConn* conn = (UringConn*)(uintptr_t)(cqe.user_data 
+                    & ~(uint64_t)OP_MASK);
+            if (op == OP_ACCEPT) {
+                on_accept(shard, &ring, &cqe);
+                continue;
+            }
+            if (op == OP_RECV) {
+                on_recv(shard, &ring, conn, &cqe);
+            } else if (op == OP_SEND) {
+                on_send(shard, &ring, conn, &cqe);
+            } else if (op == OP_DONE) {
+                on_done(shard, &ring, conn);
+            } else {
+                conn->ops--;
+            }
+            reap_conn(server, conn);
+        }
+    }
+    return NULL;
+}
+
+/* Opens a socket listening on the provided port. With reusePort set, other
+ * sockets may listen on the same port and the kernel spreads incoming 
+ * connections between them. Exits the program if the socket cannot be 
+ * opened. 
+ *
+ * Returns the listening socket. 
+ */
+int open_listener(const char* portNum, bool reusePort) {
+    struct addrinfo* ai = 0;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;          
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;  
+    int err;
+    if ((err = getaddrinfo(NULL, portNum, &hints, &ai))) {
+        freeaddrinfo(ai);
+        err_exit(LISTEN);
+    }
+
+    int serv = socket(AF_INET, SOCK_STREAM, 0);
+    int v = 1;
+    setsockopt(serv, SOL_SOCKET, SO_REUSEADDR, &v, sizeof(v));
+    if (reusePort) {
+        setsockopt(serv, SOL_SOCKET, SO_REUSEPORT, &v, sizeof(v));
+    }
+
+    if (bind(serv, (struct sockaddr*)ai->ai_addr, sizeof(struct sockaddr))) {
+        err_exit(LISTEN);
+    }
+    freeaddrinfo(ai);
+
+    if (listen(serv, SOMAXCONN)) {  
+        err_exit(LISTEN);
+    }
+    return serv;
+}
+
+/* Opens a Unix domain socket listening at the provided path, replacing any
+ * stale socket left there by an earlier run. Anything else at the path is 
+ * left alone, so the bind fails. Exits the program if the socket cannot be
+ * opened. 
+ *
+ * Returns the listening socket. 
+ */
+int open_unix_listener(const char* path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        err_exit(LISTEN);
+    }
+    strcpy(addr.sun_path, path);
+
+    int serv = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (serv < 0) {
+        err_exit(LISTEN);
+    }
+    struct stat st;
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode)) {
+        unlink(path);
+    }
+    if (bind(serv, (struct sockaddr*)&addr, sizeof(struct sockaddr_un))) {
+        err_exit(LISTEN);
+    }
+    if (listen(serv, SOMAXCONN)) {
+        err_exit(LISTEN);
+    }
+    return serv;
+}
+
+/* Splits the CPUs this process may run on between the provided shards in
+ * contiguous runs, so neighbouring CPUs that share caches serve the same
+ * shard. With more shards than CPUs, CPUs are shared between shards. 
+ */
+void assign_cpus(Shard* shards, int numShards) {
+    cpu_set_t allowed;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    int cpus[CPU_SETSIZE];
+    int numCpus = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[numCpus++] = cpu;
+        }
+    }
+    for (int i = 0; i < numShards; i++) {
+        int low = i * numCpus / numShards;
+        int high = (i + 1) * numCpus / numShards;
+        if (high == low) {
+            high = low + 1;
+        }
+        CPU_ZERO(&shards[i].cpus);
+        for (int j = low; j < high; j++) {
+            CPU_SET(cpus[j], &shards[i].cpus);
+        }
+    }
+}
+
+/* Accepts connections on the provided shard's listening socket and starts a
+ * client thread for each. When the shard is pinned this thread, and so the
+ * client threads it creates, only run on the shard's CPUs. 
+ */
+void* accept_thread(void* arg) {
+    Shard* shard = (Shard*)arg;
+    if (shard->pinned) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), 
+                &shard->cpus);
+    }
+
+    int connFd;
+    while (connFd = accept(shard->serv, 0, 0), connFd >= 0) {
+        ClientArgs* clientArgs = malloc(sizeof(ClientArgs));
+        clientArgs->fd = connFd;
+        clientArgs->local = false;
+        clientArgs->shard = shard;
+        pthread_t threadId;
+        pthread_create(&threadId, NULL, client_thread, clientArgs);
+        pthread_detach(threadId);
+    }
+    return NULL;
+}
+
+/* Accepts connections on the server's Unix domain socket and starts a 
+ * client thread for each, handing them to the shards in turn. These local
+ * connections are always served by client threads, which can switch them 
+ * to shared memory. A client thread for a pinned shard only runs on the 
+ * shard's CPUs, as if its own accept thread had started it. 
+ */
+void* unix_accept_thread(void* arg) {
+    Server* server = (Server*)arg;
+    unsigned long next = 0;
+
+    int connFd;
+    while (connFd = accept(server->unixServ, 0, 0), connFd >= 0) {
+        ClientArgs* clientArgs = malloc(sizeof(ClientArgs));
+        clientArgs->fd = connFd;
+        clientArgs->local = true;
+        Shard* shard = &server->shards[next++ % server->numShards];
+        clientArgs->shard = shard;
+        start_thread(shard, client_thread, clientArgs);
+    }
+    return NULL;
+}
+
+/* Parses the provided comma separated list of host:port peer addresses. 
+ * Exits the program with the usage message if an address has no port. 
+ *
+ * Returns the peers parsed, with their number stored in numPeers. 
+ */
+Peer* parse_peers(char* list, int* numPeers) {
+    char** addresses = split_by_char(strdup(list), ',', 0);
+    *numPeers = 0;
+    while (addresses[*numPeers]) {
+        (*numPeers)++;
+    }
+    Peer* peers = calloc(*numPeers, sizeof(Peer));
+    for (int i = 0; i < *numPeers; i++) {
+        char* colon = strrchr(addresses[i], ':');
+        if (!colon || colon == addresses[i] || !colon[1]) {
+            err_exit(USAGE);
+        }
+        *colon = '\0';
+        peers[i].host = addresses[i];
+        peers[i].port = colon + 1;
+    }
+    free(addresses);
+    return peers;
+}
+
+int main(int argc, char** argv) {
+    Args args;
+    args = parse_args(argc, argv);
+    Server server;
+    server.cancelled = 0;
+    server.activeConnections = 0;
+    server.pendingSegs = 0;
+    server.maxPending = args.maxPending;
+    server.shed = 0;
+    server.nsPerUnit = INITIAL_NS_PER_UNIT;
+    server.numShards = args.shards;
+    if (args.shards == UNSHARDED) {
+        server.numShards = 1;
+    } else if (args.shards == AUTO_SHARDS) {
+        cpu_set_t allowed;
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        server.numShards = CPU_COUNT(&allowed);
+    }
+    server.shards = calloc(server.numShards, sizeof(Shard));
+    bool pinned = args.shards != UNSHARDED;
+    if (pinned) {
+        assign_cpus(server.shards, server.numShards);
+    }
+
+    char portNum[MAX_LINE];
+    strcpy(portNum, args.portNum);
+    server.numWorkers = 0;
+    server.maxThr = args.maxThr;
+    for (int i = 0; i < server.numShards; i++) {
+        Shard* shard = &server.shards[i];
+        shard->server = &server;
+        shard->pinned = pinned;
+        shard->serv = open_listener(portNum, pinned);
+        if (i == 0) {
+            struct sockaddr_in ad;
+            memset(&ad, 0, sizeof(struct sockaddr_in));
+            socklen_t len = sizeof(struct sockaddr_in);
+            if (getsockname(shard->serv, (struct sockaddr*)&ad, &len)) {
+                err_exit(LISTEN);
+            }
+            sprintf(portNum, "%d", ntohs(ad.sin_port));
+        }
+        int workers = pinned ? CPU_COUNT(&shard->cpus) 
+                : sysconf(_SC_NPROCESSORS_ONLN);
+        start_pool(&shard->pool, workers, pinned ? &shard->cpus : NULL);
+        server.numWorkers += workers;
+    }
+    if (args.unixPath) {
+        server.unixServ = open_unix_listener(args.unixPath);
+    }
+    if (args.traceEvery || args.tracePath) {
+        trace_enable(args.traceEvery ? args.traceEvery : 1);
+    }
+    if (args.tracePath && !trace_flush_to(args.tracePath)) {
+        err_exit(TRACE_FILE);
+    }
+    server.store = NULL;
+    if (args.storePath && !(server.store = store_open(args.storePath))) {
+        err_exit(RESULT_STORE);
+    }
+    server.peers = NULL;
+    server.numPeers = 0;
+    if (args.peers) {
+        server.peers = parse_peers(args.peers, &server.numPeers);
+    }
+    bool fallback = args.io == IO_URING && !uring_supported();
+    fprintf(stderr, "%s\n", portNum);
+    if (fallback) {
+        fprintf(stderr, "intserver: io_uring unavailable, using threads\n");
+    }
+    fflush(stderr);
+
+    if (args.unixPath) {
+        pthread_t threadId;
+        pthread_create(&threadId, NULL, unix_accept_thread, &server);
+        pthread_detach(threadId);
+    }
+    if (server.numPeers) {
+        pthread_t threadId;
+        pthread_create(&threadId, NULL, probe_thread, &server);
+        pthread_detach(threadId);
+    }
+    void* (*serve)(void*) = args.io == IO_URING && !fallback 
+            ? uring_thread : accept_thread;
+    pthread_t* threads = malloc(sizeof(pthread_t) * server.numShards);
+    for (int i = 0; i < server.numShards; i++) {
+        pthread_create(&threads[i], NULL, serve, &server.shards[i]);
+    }
+    for (int i = 0; i < server.numShards; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    
+    return 0;
+}
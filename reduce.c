@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include "reduce.h"
+
+/* Returns the first of the numLeaves leaves split between thr chunks that 
+ * belongs to the provided chunk. Chunks get consecutive runs of leaves 
+ * differing in length by at most one. 
+ */
+long reduce_chunk_first(long numLeaves, int thr, int chunk) {
+    long extra = numLeaves % thr;
+    return numLeaves / thr * chunk + (chunk < extra ? chunk : extra);
+}
+
+/* Starts the provided reduction of a run of leaves beginning at leaf first.
+ */
+void reduce_start(Reduction* reduction, long first) {
+    reduction->first = first;
+    reduction->present = 0;
+    reduction->nodes = NULL;
+    reduction->numNodes = 0;
+}
+
+/* Adds a finished node with the provided level, index and sum to the
+ * provided reduction's nodes.
+ */
+static void emit(Reduction* reduction, int level, long index, double sum) {
+    reduction->nodes = realloc(reduction->nodes,
+            sizeof(SumNode) * (reduction->numNodes + 1));
+    SumNode* node = &reduction->nodes[reduction->numNodes++];
+    node->level = level;
+    node->index = index;
+    node->sum = sum;
+}
+
+/* Adds the sum of the complete subtree with the provided level and index, 
+ * which must start at the leaf after the last one added, to the provided 
+ * reduction. Whenever the subtree is a right subtree whose left sibling is
+ * pending, the two are added left to right and the sum carried up a level,
+ * so every subtree's sum is formed the same way whichever chunks its leaves
+ * were split between. A right subtree whose sibling lies before the run is
+ * finished straight away.
+ */
+static void add_node(Reduction* reduction, int level, long index,
+        double value) {
+    while (index & 1) {
+        if (((index - 1) << level) < reduction->first) {
+            emit(reduction, level, index, value);
+            return;
+        }
+        value = reduction->pending[level] + value;
+        reduction->present &= ~(1ULL << level);
+        level++;
+        index >>= 1;
+    }
+    reduction->pending[level] = value;
+    reduction->pendingIndex[level] = index;
+    reduction->present |= 1ULL << level;
+}
+
+/* Adds the value of the provided leaf, which must be the leaf after the last
+ * one added, to the provided reduction.
+ */
+void reduce_add(Reduction* reduction, long leaf, double value) {
+    add_node(reduction, 0, leaf, value);
+}
+
+/* Adds the values of the n leaves starting at the provided leaf, which must
+ * be the leaf after the last one added, to the provided reduction. Each 
+ * aligned run of leaves forming a complete subtree of at most REDUCE_BATCH
+ * leaves is summed pairwise here and added as one node, which gives the 
+ * same sums as adding its leaves one at a time for a fraction of the cost.
+ */
+void reduce_add_run(Reduction* reduction, long leaf, const double* values,
+        int n) {
+    double sums[REDUCE_BATCH];
+    int done = 0;
+    while (done < n) {
+        long at = leaf + done;
+        int level = 0;
+        while ((2 << level) <= REDUCE_BATCH && done + (2 << level) <= n
+                && !(at & ((2L << level) - 1))) {
+            level++;
+        }
+        int width = 1 << level;
+        for (int i = 0; i < width; i++) {
+            sums[i] = values[done + i];
+        }
+        for (; width > 1; width /= 2) {
+            for (int i = 0; i < width / 2; i++) {
+                sums[i] = sums[2 * i] + sums[2 * i + 1];
+            }
+        }
+        add_node(reduction, level, at >> level, sums[0]);
+        done += 1 << level;
+    }
+}
+
+/* Finishes every subtree of the provided reduction still waiting for its
+ * right sibling, which lies after the run.
+ */
+void reduce_finish(Reduction* reduction) {
+    for (int level = 0; level < REDUCE_LEVELS; level++) {
+        if (reduction->present & (1ULL << level)) {
+            emit(reduction, level, reduction->pendingIndex[level],
+                    reduction->pending[level]);
+        }
+    }
+    reduction->present = 0;
+}
+
+/* Orders nodes by level and then index for qsort and bsearch.
+ */
+static int compare_nodes(const void* a, const void* b) {
+    const SumNode* x = (const SumNode*)a;
+    const SumNode* y = (const SumNode*)b;
+    if (x->level != y->level) {
+        return x->level - y->level;
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/* Returns the sum of the node of the tree at the provided level and index,
+ * taken from the sorted nodes if a chunk finished it and otherwise formed
+ * from its two children. Leaves from limit on, which no node covers, count
+ * as 0.
+ */
+static double tree_value(const SumNode* nodes, int numNodes, int level,
+        long index, long limit) {
+    if ((index << level) >= limit) {
+        return 0;
+    }
+    SumNode key;
+    key.level = level;
+    key.index = index;
+    const SumNode* found = bsearch(&key, nodes, numNodes, sizeof(SumNode),
+            compare_nodes);
+    if (found) {
+        return found->sum;
+    }
+    if (level == 0) {
+        return 0;
+    }
+    return tree_value(nodes, numNodes, level - 1, index * 2, limit)
+            + tree_value(nodes, numNodes, level - 1, index * 2 + 1, limit);
+}
+
+/* Combines the nodes finished by every chunk of a reduction over numLeaves
+ * leaves into the sum at the root of the tree. The shape of the tree
+ * depends only on numLeaves, so the total is the same to the last bit
+ * however the leaves were split into chunks. Subtrees lying wholly past 
+ * the last leaf any node covers are taken as 0 without being walked, so 
+ * reducing the few nodes of an abandoned job stays cheap. Sorts nodes in 
+ * place.
+ *
+ * Returns the total.
+ */
+double reduce_total(SumNode* nodes, int numNodes, long numLeaves) {
+    int top = 0;
+    while ((1L << top) < numLeaves) {
+        top++;
+    }
+    long limit = 0;
+    for (int i = 0; i < numNodes; i++) {
+        long end = (nodes[i].index + 1) << nodes[i].level;
+        if (end > limit) {
+            limit = end;
+        }
+    }
+    if (limit > numLeaves) {
+        limit = numLeaves;
+    }
+    qsort(nodes, numNodes, sizeof(SumNode), compare_nodes);
+    return tree_value(nodes, numNodes, top, 0, limit);
+}
@@ -0,0 +1,49 @@
+/*
+ * reduce.h
+ */
+
+#ifndef REDUCE_H
+#define REDUCE_H
+
+#include <stdint.h>
+
+// Levels of the summation tree, enough for any number of leaves a long can
+// count
+#define REDUCE_LEVELS 64
+
+// Most leaves reduce_add_run sums into a single subtree before adding it to 
+// the reduction
+#define REDUCE_BATCH 64
+
+/* Represents a node of the pairwise summation tree over a job's leaves: the
+ * sum of leaves index << level up to (index + 1) << level.
+ */
+typedef struct {
+    int level;
+    long index;
+    double sum;
+} SumNode;
+
+/* Represents one chunk's pairwise summation of a contiguous run of leaves
+ * starting at first. Each complete subtree waiting for its right sibling
+ * is kept in pending at its level, with present marking the levels in use.
+ * Nodes that can go no higher within the run end up in nodes.
+ */
+typedef struct {
+    long first;
+    uint64_t present;
+    double pending[REDUCE_LEVELS];
+    long pendingIndex[REDUCE_LEVELS];
+    SumNode* nodes;
+    int numNodes;
+} Reduction;
+
+long reduce_chunk_first(long numLeaves, int thr, int chunk);
+void reduce_start(Reduction* reduction, long first);
+void reduce_add(Reduction* reduction, long leaf, double value);
+void reduce_add_run(Reduction* reduction, long leaf, const double* values,
+        int n);
+void reduce_finish(Reduction* reduction);
+double reduce_total(SumNode* nodes, int numNodes, long numLeaves);
+
+#endif
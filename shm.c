@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "shm.h"
+
+// Mask giving a byte count's position in a ring
+#define RING_MASK (SHM_RING_BYTES - 1)
+
+// Bytes in a frame's length prefix, and so in a skip marker
+#define PREFIX 4
+
+// Times a waiter checks for an event before going to sleep on its futex
+#define SPIN_ITERS 2000
+
+// Seals a region's memory file must carry, so neither side can change its 
+// size under the other's mapping
+#define SIZE_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+
+// Milliseconds and nanoseconds per second
+#define MS_PER_SEC 1000
+#define NS_PER_MS 1000000
+
+/* Creates a new shared region backed by an anonymous memory file, sealed
+ * at the region's size, and maps it into region.
+ *
+ * Returns the file descriptor of the region, or -1 if it cannot be made.
+ */
+int shm_create(ShmRegion** region) {
+    int fd = memfd_create("intshm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(ShmRegion)) 
+            || fcntl(fd, F_ADD_SEALS, SIZE_SEALS) 
+            || !(*region = shm_map(fd))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Maps the shared region with the provided file descriptor, which must be
+ * exactly the size of a region and sealed against shrinking or growing so
+ * the mapping can never fault.
+ *
+ * Returns the region, or NULL if it cannot be mapped.
+ */
+ShmRegion* shm_map(int fd) {
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (fstat(fd, &st) || st.st_size != sizeof(ShmRegion) || seals < 0
+            || (seals & SIZE_SEALS) != SIZE_SEALS) {
+        return NULL;
+    }
+    void* region = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, 0);
+    return region == MAP_FAILED ? NULL : region;
+}
+
+void shm_unmap(ShmRegion* region) {
+    munmap(region, sizeof(ShmRegion));
+}
+
+/* Passes the file descriptor fd to the other end of the Unix domain socket
+ * sock.
+ *
+ * Returns false if it cannot be sent, true otherwise.
+ */
+bool shm_send_fd(int sock, int fd) {
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
+
+/* Receives a file descriptor passed by shm_send_fd on the Unix domain
+ * socket sock.
+ *
+ * Returns the file descriptor received, or -1 if none arrived.
+ */
+int shm_recv_fd(int sock) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        return -1;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+/* Finds maxLen contiguous free bytes at the producing end of the provided
+ * ring for a frame to be written straight into, skipping the end of the
+ * ring if the space there is too short. Only the ring's producer may call
+ * this.
+ *
+ * Returns the space found, or NULL if the ring is too full.
+ */
+char* shm_reserve(ShmRing* ring, int maxLen) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+    uint32_t toEnd = SHM_RING_BYTES - (tail & RING_MASK);
+    uint32_t skip = toEnd < maxLen ? toEnd : 0;
+    if (SHM_RING_BYTES - (tail - head) < skip + maxLen) {
+        return NULL;
+    }
+    if (skip) {
+        if (skip >= PREFIX) {
+            memset(ring->data + (tail & RING_MASK), 0, PREFIX);
+        }
+        __atomic_store_n(&ring->tail, tail + skip, __ATOMIC_RELEASE);
+    }
+    return ring->data + ((tail + skip) & RING_MASK);
+}
+
+/* Makes the len bytes written to the space returned by shm_reserve visible
+ * to the ring's consumer.
+ */
+void shm_publish(ShmRing* ring, int len) {
+    __atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_RELEASE);
+}
+
+/* Finds the next frame at the consuming end of the provided ring, passing
+ * over any skipped space. Only the ring's consumer may call this.
+ *
+ * Returns the start of the frame with the contiguous bytes available from
+ * there stored in avail, or NULL if the ring is empty.
+ */
+const char* shm_peek(ShmRing* ring, int* avail) {
+    while (true) {
+        uint32_t head = ring->head;
+        uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            return NULL;
+        }
+        uint32_t toEnd = SHM_RING_BYTES - (head & RING_MASK);
+        const char* start = ring->data + (head & RING_MASK);
+        uint32_t marker = 0;
+        if (toEnd >= PREFIX) {
+            memcpy(&marker, start, PREFIX);
+        }
+        if (marker) {
+            *avail = tail - head < toEnd ? tail - head : toEnd;
+            return start;
+        }
+        __atomic_store_n(&ring->head, head + toEnd, __ATOMIC_RELEASE);
+    }
+}
+
+/* Frees the len bytes of the frame returned by shm_peek for the producer to
+ * reuse.
+ */
+void shm_consume(ShmRing* ring, int len) {
+    __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+}
+
+/* Tells the side sleeping on the provided waiter that something happened,
+ * waking it with a system call only if it is asleep.
+ */
+void shm_notify(ShmWaiter* waiter) {
+    __atomic_add_fetch(&waiter->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiter->sleeping, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &waiter->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/* Waits until the provided waiter's seq differs from seen or timeoutMs
+ * milliseconds pass. Spins briefly first so a prompt event is caught
+ * without sleeping.
+ *
+ * Returns false if the wait timed out, true otherwise.
+ */
+bool shm_wait(ShmWaiter* waiter, uint32_t seen, int timeoutMs) {
+    for (int i = 0; i < SPIN_ITERS; i++) {
+        if (__atomic_load_n(&waiter->seq, __ATOMIC_ACQUIRE) != seen) {
+            return true;
+        }
+    }
+    __atomic_store_n(&waiter->sleeping, 1, __ATOMIC_SEQ_CST);
+    bool woken = true;
+    if (__atomic_load_n(&waiter->seq, __ATOMIC_SEQ_CST) == seen) {
+        struct timespec timeout;
+        timeout.tv_sec = timeoutMs / MS_PER_SEC;
+        timeout.tv_nsec = (long)(timeoutMs % MS_PER_SEC) * NS_PER_MS;
+        woken = !(syscall(SYS_futex, &waiter->seq, FUTEX_WAIT, seen,
+                &timeout, NULL, 0) && errno == ETIMEDOUT);
+    }
+    __atomic_store_n(&waiter->sleeping, 0, __ATOMIC_RELAXED);
+    return woken;
+}
@@ -0,0 +1,68 @@
+/*
+ * shm.h
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Upgrade token a client connected over a Unix domain socket sends to move
+// its binary frames into shared memory. After the server's 101 Switching
+// Protocols the client passes it the region's file descriptor over the
+// socket and all frames go through the region's rings from then on.
+#define SHM_PROTOCOL "intshm"
+
+// Bytes of frame data each ring holds, a power of two
+#define SHM_RING_BYTES 65536
+
+/* Represents a single producer, single consumer ring of frames in shared
+ * memory. head and tail count bytes consumed and produced since the ring
+ * was created. A frame never wraps around the end of data; the producer
+ * skips the space left at the end instead, marking the skip with a zero
+ * length prefix when there is room for one.
+ */
+typedef struct {
+    uint32_t head;
+    uint32_t tail;
+    char data[SHM_RING_BYTES];
+} ShmRing;
+
+/* Represents a futex a side of the connection sleeps on. seq is bumped by
+ * every event the side may be waiting for and sleeping is set while it is
+ * asleep, so events only make a system call when it is.
+ */
+typedef struct {
+    uint32_t seq;
+    uint32_t sleeping;
+} ShmWaiter;
+
+/* Represents the region shared between a client and the server: request
+ * frames flow from client to server and reply frames back. closed is set
+ * by the client when it has finished with the region.
+ */
+typedef struct {
+    ShmRing requests;
+    ShmRing replies;
+    ShmWaiter server;
+    ShmWaiter client;
+    uint32_t closed;
+} ShmRegion;
+
+int shm_create(ShmRegion** region);
+ShmRegion* shm_map(int fd);
+void shm_unmap(ShmRegion* region);
+
+bool shm_send_fd(int sock, int fd);
+int shm_recv_fd(int sock);
+
+char* shm_reserve(ShmRing* ring, int maxLen);
+void shm_publish(ShmRing* ring, int len);
+const char* shm_peek(ShmRing* ring, int* avail);
+void shm_consume(ShmRing* ring, int len);
+
+void shm_notify(ShmWaiter* waiter);
+bool shm_wait(ShmWaiter* waiter, uint32_t seen, int timeoutMs);
+
+#endif
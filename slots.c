@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "slots.h"
+
+static ThreadSlot* allSlots = NULL;
+static ThreadSlot* freeSlots = NULL;
+static int numSlots = 0;
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t releaseKey;
+static pthread_once_t keyOnce = PTHREAD_ONCE_INIT;
+static __thread ThreadSlot* localSlot = NULL;
+
+/* Returns the calling thread's slot to the free list when it exits.
+ */
+static void release_slot(void* arg) {
+    ThreadSlot* slot = (ThreadSlot*)arg;
+    pthread_mutex_lock(&registryLock);
+    slot->nextFree = freeSlots;
+    freeSlots = slot;
+    pthread_mutex_unlock(&registryLock);
+}
+
+static void make_key(void) {
+    pthread_key_create(&releaseKey, release_slot);
+}
+
+/* Finds the slot owned by the calling thread, taking one from the free list
+ * or allocating and publishing a new one on first use.
+ *
+ * Returns the calling thread's slot.
+ */
+ThreadSlot* slots_local(void) {
+    if (localSlot) {
+        return localSlot;
+    }
+    pthread_once(&keyOnce, make_key);
+    pthread_mutex_lock(&registryLock);
+    ThreadSlot* slot = freeSlots;
+    if (slot) {
+        freeSlots = slot->nextFree;
+    } else {
+        slot = calloc(1, sizeof(ThreadSlot));
+        slot->id = ++numSlots;
+        slot->next = allSlots;
+        __atomic_store_n(&allSlots, slot, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&registryLock);
+    pthread_setspecific(releaseKey, slot);
+    localSlot = slot;
+    return slot;
+}
+
+/* Returns the most recently made slot, from which every slot can be reached
+ * through next without locking.
+ */
+ThreadSlot* slots_first(void) {
+    return __atomic_load_n(&allSlots, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,30 @@
+/*
+ * slots.h
+ */
+
+#ifndef SLOTS_H
+#define SLOTS_H
+
+// Kinds of per-thread block a thread's slot can hold
+typedef enum {
+    SLOT_STATS,
+    SLOT_TRACE,
+    NUM_SLOT_KINDS
+} SlotKind;
+
+/* Represents the blocks of per-thread data owned by a single thread, one of
+ * each kind, each set by the owning thread on first use. Slots are never
+ * freed; when a thread exits its slot, blocks and all, is handed to the
+ * next new thread. id numbers the slots from 1 in the order they were made.
+ */
+typedef struct ThreadSlot {
+    int id;
+    void* blocks[NUM_SLOT_KINDS];
+    struct ThreadSlot* next;
+    struct ThreadSlot* nextFree;
+} ThreadSlot;
+
+ThreadSlot* slots_local(void);
+ThreadSlot* slots_first(void);
+
+#endif
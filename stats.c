@@ -0,0 +1,322 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+#include "slots.h"
+
+// Each power of two is split into 2^SUB_BITS histogram buckets
+#define SUB_BITS 2
+#define SUBS (1 << SUB_BITS)
+#define NUM_BUCKETS (64 << SUB_BITS)
+
+// Status codes counted separately, anything else is counted as "other"
+#define NUM_STATUSES 4
+static const int statusCodes[NUM_STATUSES - 1] = {200, 400, 503};
+
+// Nanoseconds per second
+#define NS_PER_SEC 1e9
+
+// Smallest Prometheus bucket bound written, in nanoseconds
+#define MIN_BOUND_NS 1024
+
+static const char* kindNames[NUM_KINDS] = {
+    "validate", "integrate", "stats", "estimate", "other"
+};
+static const char* phaseNames[NUM_PHASES] = {
+    "read", "parse", "compile", "integrate", "write"
+};
+
+/* Represents a log-bucketed histogram of durations in nanoseconds.
+ */
+typedef struct {
+    uint64_t buckets[NUM_BUCKETS];
+    uint64_t count;
+    uint64_t sumNs;
+} Histogram;
+
+/* Represents the counters written by a single thread, kept in its slot. 
+ * Only the owning thread writes to a block, so updates are plain relaxed 
+ * stores and never contend. A block stays with its slot when the thread 
+ * exits, so the counters stay cumulative.
+ */
+typedef struct {
+    uint64_t requests[NUM_KINDS][NUM_STATUSES];
+    Histogram latency[NUM_KINDS];
+    Histogram phases[NUM_PHASES];
+} ThreadStats;
+
+static __thread ThreadStats* localStats = NULL;
+
+/* Returns the current monotonic time in nanoseconds.
+ */
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Finds the block in the calling thread's slot, allocating and publishing 
+ * one if the slot has none yet.
+ *
+ * Returns the calling thread's block.
+ */
+static ThreadStats* get_stats(void) {
+    if (localStats) {
+        return localStats;
+    }
+    ThreadSlot* slot = slots_local();
+    ThreadStats* stats = slot->blocks[SLOT_STATS];
+    if (!stats) {
+        stats = calloc(1, sizeof(ThreadStats));
+        __atomic_store_n(&slot->blocks[SLOT_STATS], stats, __ATOMIC_RELEASE);
+    }
+    localStats = stats;
+    return stats;
+}
+
+/* Returns the block held by the provided slot, or NULL if it has none.
+ */
+static ThreadStats* slot_stats(ThreadSlot* slot) {
+    return __atomic_load_n(&slot->blocks[SLOT_STATS], __ATOMIC_ACQUIRE);
+}
+
+/* Adds n to a counter only ever written by the calling thread.
+ */
+static inline void bump(uint64_t* counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+            __ATOMIC_RELAXED);
+}
+
+/* Returns the index of the histogram bucket holding the value ns.
+ */
+static inline int bucket_of(uint64_t ns) {
+    if (ns < SUBS) {
+        return ns;
+    }
+    int msb = 63 - __builtin_clzll(ns);
+    return ((msb - SUB_BITS + 1) << SUB_BITS)
+            | ((ns >> (msb - SUB_BITS)) & (SUBS - 1));
+}
+
+/* Returns the smallest value held by the provided histogram bucket.
+ */
+static uint64_t bucket_low(int bucket) {
+    if (bucket < SUBS) {
+        return bucket;
+    }
+    int msb = (bucket >> SUB_BITS) + SUB_BITS - 1;
+    return (uint64_t)(SUBS | (bucket & (SUBS - 1))) << (msb - SUB_BITS);
+}
+
+static inline void record(Histogram* hist, uint64_t ns) {
+    bump(&hist->buckets[bucket_of(ns)], 1);
+    bump(&hist->count, 1);
+    bump(&hist->sumNs, ns);
+}
+
+/* Counts a completed request of the given kind and status which took ns
+ * nanoseconds from first byte read to response written.
+ */
+void stats_record_request(RequestKind kind, int status, uint64_t ns) {
+    ThreadStats* stats = get_stats();
+    int i = 0;
+    while (i < NUM_STATUSES - 1 && statusCodes[i] != status) {
+        i++;
+    }
+    bump(&stats->requests[kind][i], 1);
+    record(&stats->latency[kind], ns);
+}
+
+/* Records that the given phase of a request took ns nanoseconds.
+ */
+void stats_record_phase(Phase phase, uint64_t ns) {
+    record(&get_stats()->phases[phase], ns);
+}
+
+/* Sums the histogram selected by the provided accessor over every thread's
+ * block into total.
+ */
+static void sum_histograms(Histogram* total,
+        Histogram* (*select)(ThreadStats*, int), int index) {
+    memset(total, 0, sizeof(Histogram));
+    for (ThreadSlot* slot = slots_first(); slot; slot = slot->next) {
+        ThreadStats* stats = slot_stats(slot);
+        if (!stats) {
+            continue;
+        }
+        Histogram* hist = select(stats, index);
+        for (int i = 0; i < NUM_BUCKETS; i++) {
+            total->buckets[i] +=
+                    __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+        }
+        total->count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+        total->sumNs += __atomic_load_n(&hist->sumNs, __ATOMIC_RELAXED);
+    }
+}
+
+static Histogram* select_latency(ThreadStats* stats, int kind) {
+    return &stats->latency[kind];
+}
+
+static Histogram* select_phase(ThreadStats* stats, int phase) {
+    return &stats->phases[phase];
+}
+
+/* Returns the total number of requests of the given kind and status index
+ * over every thread's block.
+ */
+static uint64_t sum_requests(int kind, int status) {
+    uint64_t total = 0;
+    for (ThreadSlot* slot = slots_first(); slot; slot = slot->next) {
+        ThreadStats* stats = slot_stats(slot);
+        if (stats) {
+            total += __atomic_load_n(&stats->requests[kind][status],
+                    __ATOMIC_RELAXED);
+        }
+    }
+    return total;
+}
+
+/* Estimates the value below which the fraction q of the histogram's values
+ * fall. The estimate is the upper bound of the bucket containing it.
+ *
+ * Returns the estimate in nanoseconds, or 0 if the histogram is empty.
+ */
+static uint64_t quantile(const Histogram* hist, double q) {
+    if (!hist->count) {
+        return 0;
+    }
+    uint64_t target = q * hist->count;
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS - 1; i++) {
+        seen += hist->buckets[i];
+        if (seen > target) {
+            return bucket_low(i + 1);
+        }
+    }
+    return UINT64_MAX;
+}
+
+static void write_json_histogram(FILE* out, const char* name,
+        const Histogram* hist) {
+    fprintf(out, "\"%s\":{\"count\":%lu,\"sum_ns\":%lu,\"p50_ns\":%lu,"
+            "\"p90_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu}", name,
+            hist->count, hist->sumNs, quantile(hist, 0.5),
+            quantile(hist, 0.9), quantile(hist, 0.99), quantile(hist, 0.999));
+}
+
+/* Writes every counter, gauge and histogram summary to out as a single JSON
+ * object.
+ */
+void stats_write_json(FILE* out, const StatsGauges* gauges) {
+    Histogram hist;
+    fprintf(out, "{\"requests\":{");
+    for (int kind = 0; kind < NUM_KINDS; kind++) {
+        fprintf(out, "%s\"%s\":{", kind ? "," : "", kindNames[kind]);
+        for (int i = 0; i < NUM_STATUSES; i++) {
+            if (i < NUM_STATUSES - 1) {
+                fprintf(out, "\"%d\":", statusCodes[i]);
+            } else {
+                fprintf(out, ",\"other\":");
+            }
+            fprintf(out, "%lu%s", sum_requests(kind, i),
+                    i < NUM_STATUSES - 2 ? "," : "");
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "},\"active_connections\":%ld,\"pool_workers\":%d,"
+            "\"queue_depth\":%d,\"cancelled\":%lu,\"pending_segments\":%ld,"
+            "\"max_pending_segments\":%ld,\"shed\":%lu,\"latency\":{",
+            gauges->activeConnections, gauges->poolWorkers,
+            gauges->queueDepth, gauges->cancelled, gauges->pendingSegs,
+            gauges->maxPending, gauges->shed);
+    for (int kind = 0; kind < NUM_KINDS; kind++) {
+        sum_histograms(&hist, select_latency, kind);
+        fprintf(out, "%s", kind ? "," : "");
+        write_json_histogram(out, kindNames[kind], &hist);
+    }
+    fprintf(out, "},\"phases\":{");
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+        sum_histograms(&hist, select_phase, phase);
+        fprintf(out, "%s", phase ? "," : "");
+        write_json_histogram(out, phaseNames[phase], &hist);
+    }
+    fprintf(out, "}}\n");
+}
+
+/* Writes the provided histogram as a Prometheus histogram named name with
+ * the given label. Buckets are merged to powers of two and only written from
+ * MIN_BOUND_NS up to the largest non-empty one.
+ */
+static void write_prometheus_histogram(FILE* out, const char* name,
+        const char* label, const Histogram* hist) {
+    int last = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        if (hist->buckets[i]) {
+            last = i;
+        }
+    }
+    uint64_t cumulative = 0;
+    for (int i = 0; i <= last; i++) {
+        cumulative += hist->buckets[i];
+        if (((i & (SUBS - 1)) == SUBS - 1 || i == last)
+                && bucket_low(i + 1) >= MIN_BOUND_NS) {
+            fprintf(out, "%s_bucket{%s,le=\"%.9g\"} %lu\n", name, label,
+                    bucket_low(i + 1) / NS_PER_SEC, cumulative);
+        }
+    }
+    fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %lu\n", name, label, hist->count);
+    fprintf(out, "%s_sum{%s} %.9f\n", name, label, hist->sumNs / NS_PER_SEC);
+    fprintf(out, "%s_count{%s} %lu\n", name, label, hist->count);
+}
+
+/* Writes every counter, gauge and histogram to out in the Prometheus text
+ * exposition format.
+ */
+void stats_write_prometheus(FILE* out, const StatsGauges* gauges) {
+    Histogram hist;
+    char label[64];
+    fprintf(out, "# TYPE intserver_requests_total counter\n");
+    for (int kind = 0; kind < NUM_KINDS; kind++) {
+        for (int i = 0; i < NUM_STATUSES; i++) {
+            fprintf(out, "intserver_requests_total{type=\"%s\",",
+                    kindNames[kind]);
+            if (i < NUM_STATUSES - 1) {
+                fprintf(out, "status=\"%d\"}", statusCodes[i]);
+            } else {
+                fprintf(out, "status=\"other\"}");
+            }
+            fprintf(out, " %lu\n", sum_requests(kind, i));
+        }
+    }
+    fprintf(out, "# TYPE intserver_active_connections gauge\n"
+            "intserver_active_connections %ld\n"
+            "# TYPE intserver_pool_workers gauge\n"
+            "intserver_pool_workers %d\n"
+            "# TYPE intserver_pool_queue_depth gauge\n"
+            "intserver_pool_queue_depth %d\n"
+            "# TYPE intserver_cancelled_total counter\n"
+            "intserver_cancelled_total %lu\n"
+            "# TYPE intserver_pending_segments gauge\n"
+            "intserver_pending_segments %ld\n"
+            "# TYPE intserver_max_pending_segments gauge\n"
+            "intserver_max_pending_segments %ld\n"
+            "# TYPE intserver_shed_total counter\n"
+            "intserver_shed_total %lu\n", gauges->activeConnections,
+            gauges->poolWorkers, gauges->queueDepth, gauges->cancelled,
+            gauges->pendingSegs, gauges->maxPending, gauges->shed);
+    fprintf(out, "# TYPE intserver_request_duration_seconds histogram\n");
+    for (int kind = 0; kind < NUM_KINDS; kind++) {
+        sum_histograms(&hist, select_latency, kind);
+        sprintf(label, "type=\"%s\"", kindNames[kind]);
+        write_prometheus_histogram(out, "intserver_request_duration_seconds",
+                label, &hist);
+    }
+    fprintf(out, "# TYPE intserver_phase_duration_seconds histogram\n");
+    for (int phase = 0; phase < NUM_PHASES; phase++) {
+        sum_histograms(&hist, select_phase, phase);
+        sprintf(label, "phase=\"%s\"", phaseNames[phase]);
+        write_prometheus_histogram(out, "intserver_phase_duration_seconds",
+                label, &hist);
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * stats.h
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Kinds of request counted separately
+typedef enum {
+    KIND_VALIDATE,
+    KIND_INTEGRATE,
+    KIND_STATS,
+    KIND_ESTIMATE,
+    KIND_OTHER,
+    NUM_KINDS
+} RequestKind;
+
+// Phases of handling a request that are timed separately
+typedef enum {
+    PHASE_READ,
+    PHASE_PARSE,
+    PHASE_COMPILE,
+    PHASE_INTEGRATE,
+    PHASE_WRITE,
+    NUM_PHASES
+} Phase;
+
+/* Represents the point-in-time values reported alongside the counters. These
+ * are owned by the server and filled in when the stats are rendered. 
+ */
+typedef struct {
+    long activeConnections;
+    int poolWorkers;
+    int queueDepth;
+    unsigned long cancelled;
+    long pendingSegs;
+    long maxPending;
+    unsigned long shed;
+} StatsGauges;
+
+uint64_t stats_now(void);
+
+void stats_record_request(RequestKind kind, int status, uint64_t ns);
+void stats_record_phase(Phase phase, uint64_t ns);
+
+void stats_write_json(FILE* out, const StatsGauges* gauges);
+void stats_write_prometheus(FILE* out, const StatsGauges* gauges);
+
+#endif
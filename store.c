@@ -0,0 +1,532 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "store.h"
+
+// Magic bytes at the start of a store file, changed whenever the record
+// layout changes
+#define MAGIC "INTSTOR3"
+#define HEADER_BYTES 8
+
+// Address space reserved for a mapped store file. A store that fills it
+// stops taking results until it is compacted.
+#define MAP_BYTES (1ULL << 30)
+
+// Records start on multiples of this many bytes
+#define ALIGN 8
+
+// Records the loader indexes each time it takes the lock
+#define LOAD_BATCH 1024
+
+// Slots the index starts with, a power of two
+#define MIN_SLOTS 1024
+
+// Compaction runs once dead records take up more than COMPACT_MIN_BYTES and
+// more than the live ones
+#define COMPACT_MIN_BYTES (1 << 20)
+
+// Longest expression a record holds
+#define MAX_FUNC 65535
+
+// FNV-1a parameters
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// Suffix of the file a compaction is written to before replacing the store
+#define COMPACT_SUFFIX ".compact"
+
+/* Represents one stored result as it is laid out in the file. length is the
+ * size of the whole record including padding, and check is a hash of
+ * everything after it, so a record torn by a crash part way through an
+ * append is not trusted.
+ */
+typedef struct {
+    uint32_t length;
+    uint32_t check;
+    double low;
+    double up;
+    uint32_t seg;
+    uint16_t rule;
+    uint16_t funcLen;
+    double result;
+    char func[];
+} Record;
+
+/* Represents a slot of the hash index: the key's hash and the file offset of
+ * the latest record with that key, or 0 if the slot is empty.
+ */
+typedef struct {
+    uint64_t hash;
+    uint64_t offset;
+} Slot;
+
+/* Represents an open addressing hash index over the records of a file.
+ */
+typedef struct {
+    Slot* slots;
+    uint64_t numSlots;
+    uint64_t used;
+} Index;
+
+/* Represents an open store. The file is mapped read only with MAP_BYTES of
+ * address space reserved, so records appended with pwrite are readable
+ * through the mapping straight away. Records before loadEnd were in the file
+ * when it was opened and are indexed by the loader thread, which sets end
+ * once it has found where the valid records stop; nothing is appended 
+ * before then, and later records are indexed as they are appended. dead 
+ * counts the bytes of records that are superseded. lock guards the mapping
+ * and the index; the compactor thread sleeps on wake until compacting is 
+ * set.
+ */
+struct Store {
+    char* path;
+    int fd;
+    const char* map;
+    uint64_t end;
+    uint64_t loadEnd;
+    uint64_t dead;
+    Index index;
+    bool loaded;
+    bool compacting;
+    pthread_rwlock_t lock;
+    pthread_mutex_t wakeLock;
+    pthread_cond_t wake;
+};
+
+/* Adds the provided bytes to the FNV-1a hash hash.
+ *
+ * Returns the new hash.
+ */
+static uint64_t fnv(uint64_t hash, const void* data, size_t len) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Returns the hash of a key made of the provided fields.
+ */
+static uint64_t hash_key(const char* func, int funcLen, double low,
+        double up, uint32_t seg, uint16_t rule) {
+    uint64_t hash = fnv(FNV_OFFSET, func, funcLen);
+    hash = fnv(hash, &low, sizeof(low));
+    hash = fnv(hash, &up, sizeof(up));
+    hash = fnv(hash, &seg, sizeof(seg));
+    return fnv(hash, &rule, sizeof(rule));
+}
+
+/* Returns the check value of the provided record.
+ */
+static uint32_t checksum(const Record* record) {
+    const char* start = (const char*)&record->low;
+    return fnv(FNV_OFFSET, start, (const char*)record + record->length
+            - start);
+}
+
+/* Returns the hash of the key of the provided record.
+ */
+static uint64_t record_hash(const Record* record) {
+    return hash_key(record->func, record->funcLen, record->low, record->up,
+            record->seg, record->rule);
+}
+
+/* Checks if the provided record has a key made of the provided fields.
+ *
+ * Returns true if it does, false otherwise.
+ */
+static bool same_key(const Record* record, const char* func, int funcLen,
+        double low, double up, uint32_t seg, uint16_t rule) {
+    return record->funcLen == funcLen && record->low == low
+            && record->up == up && record->seg == seg && record->rule == rule
+            && !memcmp(record->func, func, funcLen);
+}
+
+/* Returns the length of the record at the provided offset of map if it is
+ * whole, lies before limit and matches its check value, or 0 otherwise.
+ */
+static uint32_t valid_record(const char* map, uint64_t offset,
+        uint64_t limit) {
+    if (offset + sizeof(Record) > limit) {
+        return 0;
+    }
+    const Record* record = (const Record*)(map + offset);
+    if (record->length < sizeof(Record) + record->funcLen
+            || record->length % ALIGN || offset + record->length > limit
+            || checksum(record) != record->check) {
+        return 0;
+    }
+    return record->length;
+}
+
+/* Finds the slot of the provided index holding a key made of the provided
+ * fields, or the empty slot where it belongs.
+ *
+ * Returns the slot found.
+ */
+static Slot* find_slot(Index* index, const char* map, uint64_t hash,
+        const char* func, int funcLen, double low, double up, uint32_t seg,
+        uint16_t rule) {
+    uint64_t mask = index->numSlots - 1;
+    for (uint64_t i = hash & mask; ; i = (i + 1) & mask) {
+        Slot* slot = &index->slots[i];
+        if (!slot->offset || (slot->hash == hash
+                && same_key((const Record*)(map + slot->offset), func,
+                funcLen, low, up, seg, rule))) {
+            return slot;
+        }
+    }
+}
+
+/* Doubles the number of slots of the provided index.
+ */
+static void grow_index(Index* index) {
+    Index grown;
+    grown.numSlots = index->numSlots * 2;
+    grown.slots = calloc(grown.numSlots, sizeof(Slot));
+    grown.used = index->used;
+    uint64_t mask = grown.numSlots - 1;
+    for (uint64_t i = 0; i < index->numSlots; i++) {
+        Slot slot = index->slots[i];
+        if (slot.offset) {
+            uint64_t j = slot.hash & mask;
+            while (grown.slots[j].offset) {
+                j = (j + 1) & mask;
+            }
+            grown.slots[j] = slot;
+        }
+    }
+    free(index->slots);
+    *index = grown;
+}
+
+/* Indexes the record at the provided offset of map. Of two records with the
+ * same key the one later in the file wins.
+ *
+ * Returns the length of the record that lost, or 0 if the key was new.
+ */
+static uint32_t index_record(Index* index, const char* map,
+        uint64_t offset) {
+    if ((index->used + 1) * 2 > index->numSlots) {
+        grow_index(index);
+    }
+    const Record* record = (const Record*)(map + offset);
+    uint64_t hash = record_hash(record);
+    Slot* slot = find_slot(index, map, hash, record->func, record->funcLen,
+            record->low, record->up, record->seg, record->rule);
+    if (!slot->offset) {
+        slot->hash = hash;
+        slot->offset = offset;
+        index->used++;
+        return 0;
+    }
+    if (slot->offset > offset) {
+        return record->length;
+    }
+    uint32_t lost = ((const Record*)(map + slot->offset))->length;
+    slot->offset = offset;
+    return lost;
+}
+
+/* Checks if the provided store, whose lock is held for writing, has enough
+ * dead records to be worth compacting and, if so, marks it as compacting.
+ *
+ * Returns true if compaction should start, false otherwise.
+ */
+static bool should_compact(Store* store) {
+    if (!store->loaded || store->compacting
+            || store->dead < COMPACT_MIN_BYTES
+            || store->dead * 2 < store->end - HEADER_BYTES) {
+        return false;
+    }
+    store->compacting = true;
+    return true;
+}
+
+/* Wakes the provided store's compactor thread.
+ */
+static void start_compaction(Store* store) {
+    pthread_mutex_lock(&store->wakeLock);
+    pthread_cond_signal(&store->wake);
+    pthread_mutex_unlock(&store->wakeLock);
+}
+
+/* Indexes the records that were in the provided store's file when it was
+ * opened, a batch at a time so lookups carry on meanwhile. Reading stops at
+ * the first damaged record, left by a crash part way through an append; 
+ * the file is cut there so appends carry on from the last whole record.
+ */
+static void* load_thread(void* arg) {
+    Store* store = (Store*)arg;
+    uint64_t offset = HEADER_BYTES;
+    bool torn = false;
+    while (offset < store->loadEnd && !torn) {
+        pthread_rwlock_wrlock(&store->lock);
+        for (int i = 0; i < LOAD_BATCH && offset < store->loadEnd; i++) {
+            uint32_t len = valid_record(store->map, offset, store->loadEnd);
+            if (!len) {
+                torn = true;
+                break;
+            }
+            store->dead += index_record(&store->index, store->map, offset);
+            offset += len;
+        }
+        pthread_rwlock_unlock(&store->lock);
+    }
+    pthread_rwlock_wrlock(&store->lock);
+    if (torn) {
+        ftruncate(store->fd, offset);
+    }
+    store->end = offset;
+    store->loaded = true;
+    bool compact = should_compact(store);
+    pthread_rwlock_unlock(&store->lock);
+    if (compact) {
+        start_compaction(store);
+    }
+    return NULL;
+}
+
+/* Copies the record at the provided offset of the provided store's mapping
+ * to the end of the file being compacted into, and indexes it there.
+ *
+ * Returns false if it could not be written, true otherwise.
+ */
+static bool copy_record(Store* store, uint64_t offset, int fd,
+        const char* map, Index* index, uint64_t* end, uint64_t* dead) {
+    const Record* record = (const Record*)(store->map + offset);
+    if (pwrite(fd, record, record->length, *end) != record->length) {
+        return false;
+    }
+    *dead += index_record(index, map, *end);
+    *end += record->length;
+    return true;
+}
+
+/* Compares two file offsets for qsort.
+ */
+static int compare_offsets(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Flushes the directory holding the file at the provided path, so a file
+ * renamed into it survives a crash.
+ *
+ * Returns false if it could not be flushed, true otherwise.
+ */
+static bool sync_dir(const char* path) {
+    char* copy = strdup(path);
+    int fd = open(dirname(copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(copy);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = !fsync(fd);
+    close(fd);
+    return ok;
+}
+
+/* Rewrites the provided store's file with only its live records. The live
+ * records as of the start are copied without holding the lock; only the
+ * records appended meanwhile are copied with it held, just before the new
+ * file replaces the old one. The new file is flushed before the rename and
+ * its directory after, so a crash leaves either the old file or the whole
+ * new one. If anything fails the old file is kept.
+ */
+static void compact(Store* store) {
+    pthread_rwlock_rdlock(&store->lock);
+    uint64_t snapEnd = store->end;
+    uint64_t numLive = 0;
+    uint64_t* live = malloc(sizeof(uint64_t) * (store->index.used + 1));
+    for (uint64_t i = 0; i < store->index.numSlots; i++) {
+        if (store->index.slots[i].offset) {
+            live[numLive++] = store->index.slots[i].offset;
+        }
+    }
+    pthread_rwlock_unlock(&store->lock);
+    qsort(live, numLive, sizeof(uint64_t), compare_offsets);
+
+    char* tmpPath = malloc(strlen(store->path) + strlen(COMPACT_SUFFIX) + 1);
+    sprintf(tmpPath, "%s%s", store->path, COMPACT_SUFFIX);
+    int fd = open(tmpPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    const char* map = fd < 0 ? MAP_FAILED
+            : mmap(NULL, MAP_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+    Index index;
+    index.numSlots = MIN_SLOTS;
+    index.slots = calloc(index.numSlots, sizeof(Slot));
+    index.used = 0;
+    uint64_t end = HEADER_BYTES;
+    uint64_t dead = 0;
+    bool ok = map != MAP_FAILED
+            && pwrite(fd, MAGIC, HEADER_BYTES, 0) == HEADER_BYTES;
+    for (uint64_t i = 0; ok && i < numLive; i++) {
+        ok = copy_record(store, live[i], fd, map, &index, &end, &dead);
+    }
+    free(live);
+
+    pthread_rwlock_wrlock(&store->lock);
+    for (uint64_t offset = snapEnd; ok && offset < store->end; ) {
+        uint32_t len = ((const Record*)(store->map + offset))->length;
+        ok = copy_record(store, offset, fd, map, &index, &end, &dead);
+        offset += len;
+    }
+    if (ok && !fsync(fd) && !rename(tmpPath, store->path)) {
+        sync_dir(store->path);
+        munmap((void*)store->map, MAP_BYTES);
+        close(store->fd);
+        free(store->index.slots);
+        store->fd = fd;
+        store->map = map;
+        store->index = index;
+        store->end = end;
+        store->dead = dead;
+    } else {
+        if (map != MAP_FAILED) {
+            munmap((void*)map, MAP_BYTES);
+        }
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpPath);
+        }
+        free(index.slots);
+    }
+    store->compacting = false;
+    pthread_rwlock_unlock(&store->lock);
+    free(tmpPath);
+}
+
+/* Compacts the provided store each time it is woken.
+ */
+static void* compact_thread(void* arg) {
+    Store* store = (Store*)arg;
+    while (true) {
+        pthread_mutex_lock(&store->wakeLock);
+        while (!__atomic_load_n(&store->compacting, __ATOMIC_ACQUIRE)) {
+            pthread_cond_wait(&store->wake, &store->wakeLock);
+        }
+        pthread_mutex_unlock(&store->wakeLock);
+        compact(store);
+    }
+    return NULL;
+}
+
+/* Opens the store file at the provided path, creating it if it does not
+ * exist. Only the file's header is read here; its records are indexed by a
+ * background thread, so opening takes the same time however big the store
+ * is and results are found as soon as their records have been indexed. 
+ * New results are only kept once every record has been indexed.
+ *
+ * Returns the store, or NULL if the file cannot be used as a store.
+ */
+Store* store_open(const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        return NULL;
+    }
+    char magic[HEADER_BYTES];
+    if (st.st_size == 0) {
+        if (pwrite(fd, MAGIC, HEADER_BYTES, 0) != HEADER_BYTES) {
+            close(fd);
+            return NULL;
+        }
+        st.st_size = HEADER_BYTES;
+    } else if (st.st_size < HEADER_BYTES || st.st_size > MAP_BYTES
+            || pread(fd, magic, HEADER_BYTES, 0) != HEADER_BYTES
+            || memcmp(magic, MAGIC, HEADER_BYTES)) {
+        close(fd);
+        return NULL;
+    }
+    const char* map = mmap(NULL, MAP_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return NULL;
+    }
+
+    Store* store = calloc(1, sizeof(Store));
+    store->path = strdup(path);
+    store->fd = fd;
+    store->map = map;
+    store->loadEnd = st.st_size;
+    store->end = st.st_size;
+    store->index.numSlots = MIN_SLOTS;
+    store->index.slots = calloc(MIN_SLOTS, sizeof(Slot));
+    pthread_rwlock_init(&store->lock, NULL);
+    pthread_mutex_init(&store->wakeLock, NULL);
+    pthread_cond_init(&store->wake, NULL);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, load_thread, store);
+    pthread_detach(tid);
+    pthread_create(&tid, NULL, compact_thread, store);
+    pthread_detach(tid);
+    return store;
+}
+
+/* Looks up the result stored under the provided key.
+ *
+ * Returns true with the result stored in result if there is one, false
+ * otherwise.
+ */
+bool store_get(Store* store, const StoreKey* key, double* result) {
+    const char* func = key->func;
+    int funcLen = strlen(func);
+    double low = key->low + 0.0;
+    double up = key->up + 0.0;
+    uint64_t hash = hash_key(func, funcLen, low, up, key->seg, key->rule);
+    pthread_rwlock_rdlock(&store->lock);
+    Slot* slot = find_slot(&store->index, store->map, hash, func, funcLen,
+            low, up, key->seg, key->rule);
+    bool found = slot->offset != 0;
+    if (found) {
+        *result = ((const Record*)(store->map + slot->offset))->result;
+    }
+    pthread_rwlock_unlock(&store->lock);
+    return found;
+}
+
+/* Appends the provided result to the store under the provided key. The
+ * result is dropped if the expression is too long, the store is full or its
+ * records are still being indexed.
+ * Compaction is started if enough of the file has become dead.
+ */
+void store_put(Store* store, const StoreKey* key, double result) {
+    int funcLen = strlen(key->func);
+    if (funcLen > MAX_FUNC) {
+        return;
+    }
+    uint32_t length = (sizeof(Record) + funcLen + ALIGN - 1) / ALIGN * ALIGN;
+    Record* record = calloc(1, length);
+    record->length = length;
+    record->low = key->low + 0.0;
+    record->up = key->up + 0.0;
+    record->seg = key->seg;
+    record->rule = key->rule;
+    record->funcLen = funcLen;
+    record->result = result;
+    memcpy(record->func, key->func, funcLen);
+    record->check = checksum(record);
+
+    pthread_rwlock_wrlock(&store->lock);
+    bool compact = false;
+    if (store->loaded && store->end + length <= MAP_BYTES
+            && pwrite(store->fd, record, length, store->end) == length) {
+        store->dead += index_record(&store->index, store->map, store->end);
+        store->end += length;
+        compact = should_compact(store);
+    }
+    pthread_rwlock_unlock(&store->lock);
+    if (compact) {
+        start_compaction(store);
+    }
+    free(record);
+}
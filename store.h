@@ -0,0 +1,32 @@
+/*
+ * store.h
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Integration rules a result can be stored for. The rule is part of the
+// key, so results of different rules over the same range are kept apart.
+#define STORE_RULE_TRAPEZOID 0
+
+/* Represents the key a result is stored under. func is compared byte for
+ * byte, so only the same expression written the same way shares a result.
+ */
+typedef struct {
+    const char* func;
+    double low;
+    double up;
+    uint32_t seg;
+    uint16_t rule;
+} StoreKey;
+
+typedef struct Store Store;
+
+Store* store_open(const char* path);
+bool store_get(Store* store, const StoreKey* key, double* result);
+void store_put(Store* store, const StoreKey* key, double result);
+
+#endif
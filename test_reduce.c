@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "reduce.h"
+
+// Exit code when some split of the leaves gives a different total
+#define MISMATCH 1
+
+// Most chunks the leaves are split between, as with a thr of up to this
+#define MAX_THR 24
+
+// Largest number of leaves swept one at a time, and the larger counts
+// tried after that
+#define MAX_SWEPT 300
+static const long largeCounts[] = {1000, 1023, 1024, 1025, 4097, 65537};
+
+// Longest run of leaves handed to reduce_add_run at once
+#define MAX_RUN 150
+
+// Seed for the leaf values and run lengths, so failures can be reproduced
+#define SEED 2310
+
+/* Returns a random leaf value spread over many orders of magnitude and both
+ * signs, so any change in the order of the additions shows in the total.
+ */
+static double random_leaf(void) {
+    double value = (double)rand() / RAND_MAX * 1e6;
+    value /= 1 << (rand() % 20);
+    return rand() % 2 ? value : -value;
+}
+
+/* Reduces the provided leaves split between thr chunks by 
+ * reduce_chunk_first, as intserver splits a job, each chunk adding its 
+ * leaves in runs of random length, alternating between reduce_add_run and
+ * single reduce_add calls.
+ *
+ * Returns the total of the reduction.
+ */
+static double split_total(const double* leaves, long numLeaves, int thr) {
+    SumNode* nodes = NULL;
+    int numNodes = 0;
+    for (int chunk = 0; chunk < thr; chunk++) {
+        long first = reduce_chunk_first(numLeaves, thr, chunk);
+        long end = reduce_chunk_first(numLeaves, thr, chunk + 1);
+        Reduction reduction;
+        reduce_start(&reduction, first);
+        for (long leaf = first; leaf < end;) {
+            int run = 1 + rand() % MAX_RUN;
+            if (run > end - leaf) {
+                run = end - leaf;
+            }
+            if (rand() % 4) {
+                reduce_add_run(&reduction, leaf, leaves + leaf, run);
+            } else {
+                for (int i = 0; i < run; i++) {
+                    reduce_add(&reduction, leaf + i, leaves[leaf + i]);
+                }
+            }
+            leaf += run;
+        }
+        reduce_finish(&reduction);
+        nodes = realloc(nodes,
+                sizeof(SumNode) * (numNodes + reduction.numNodes));
+        memcpy(nodes + numNodes, reduction.nodes,
+                sizeof(SumNode) * reduction.numNodes);
+        numNodes += reduction.numNodes;
+        free(reduction.nodes);
+    }
+    double total = reduce_total(nodes, numNodes, numLeaves);
+    free(nodes);
+    return total;
+}
+
+/* Checks that reduce_chunk_first splits numLeaves leaves between thr chunks
+ * as consecutive runs covering every leaf, differing in length by at most 
+ * one.
+ *
+ * Returns false if the split is wrong, true otherwise.
+ */
+static bool check_split(long numLeaves, int thr) {
+    long shortest = numLeaves;
+    long longest = 0;
+    for (int chunk = 0; chunk < thr; chunk++) {
+        long length = reduce_chunk_first(numLeaves, thr, chunk + 1)
+                - reduce_chunk_first(numLeaves, thr, chunk);
+        shortest = length < shortest ? length : shortest;
+        longest = length > longest ? length : longest;
+    }
+    if (reduce_chunk_first(numLeaves, thr, 0) != 0
+            || reduce_chunk_first(numLeaves, thr, thr) != numLeaves
+            || shortest < 0 || longest - shortest > 1) {
+        fprintf(stderr, "%ld leaves, thr %d: bad split\n", numLeaves, thr);
+        return false;
+    }
+    return true;
+}
+
+/* Checks that numLeaves random leaves give the same total, to the last bit,
+ * whether they are reduced in one chunk or split between any number of
+ * chunks up to MAX_THR.
+ *
+ * Returns false if some split gave a different total, true otherwise.
+ */
+static bool check_leaves(long numLeaves) {
+    double* leaves = malloc(sizeof(double) * numLeaves);
+    for (long i = 0; i < numLeaves; i++) {
+        leaves[i] = random_leaf();
+    }
+    double expected = split_total(leaves, numLeaves, 1);
+    bool ok = true;
+    for (int thr = 2; thr <= MAX_THR; thr++) {
+        ok &= check_split(numLeaves, thr);
+        double total = split_total(leaves, numLeaves, thr);
+        if (memcmp(&total, &expected, sizeof(double))) {
+            fprintf(stderr, "%ld leaves, thr %d: got %.17g, expected %.17g\n",
+                    numLeaves, thr, total, expected);
+            ok = false;
+        }
+    }
+    free(leaves);
+    return ok;
+}
+
+int main(void) {
+    srand(SEED);
+    bool ok = true;
+    for (long numLeaves = 1; numLeaves <= MAX_SWEPT; numLeaves++) {
+        ok &= check_leaves(numLeaves);
+    }
+    for (size_t i = 0; i < sizeof(largeCounts) / sizeof(long); i++) {
+        ok &= check_leaves(largeCounts[i]);
+    }
+    if (!ok) {
+        return MISMATCH;
+    }
+    printf("reduce: every split gave the same total\n");
+    return 0;
+}
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "trace.h"
+#include "slots.h"
+
+// Spans each thread's buffer holds; once full the oldest are overwritten
+#define TRACE_EVENTS 4096
+
+// Seconds between rewrites of the trace file
+#define TRACE_FLUSH_SECS 5
+
+// Nanoseconds per microsecond, the unit of trace event timestamps
+#define NS_PER_US 1e3
+
+/* Represents one finished span: the phase or chunk of the sampled request
+ * with the provided ID that ran from start to end, in nanoseconds.
+ */
+typedef struct {
+    const char* name;
+    uint64_t request;
+    uint64_t start;
+    uint64_t end;
+    long arg;
+} TraceEvent;
+
+/* Represents the ring of spans recorded by a single thread, kept in its 
+ * slot. Only the owning thread writes to a buffer: it fills the entry for 
+ * event head and then publishes it by advancing head, so readers never take
+ * a lock and discard any entry that may have been overwritten while they 
+ * copied it. A buffer stays with its slot when the thread exits, and its 
+ * spans are shown on the thread numbered by the slot's id.
+ */
+typedef struct {
+    uint64_t head;
+    TraceEvent events[TRACE_EVENTS];
+} ThreadTrace;
+
+static long sampleEvery = 0;
+static uint64_t requests = 0;
+static __thread ThreadTrace* localTrace = NULL;
+static __thread uint64_t currentRequest = 0;
+
+/* Turns tracing on, sampling one request in each run of the provided 
+ * number of requests. Must be called before any request is served.
+ */
+void trace_enable(long every) {
+    sampleEvery = every;
+}
+
+/* Returns true if tracing was turned on, false otherwise.
+ */
+bool trace_enabled(void) {
+    return sampleEvery > 0;
+}
+
+/* Starts a new request on the calling thread, which is sampled if it is the
+ * last of a run of sampleEvery requests. The request stays the thread's
+ * current request until the thread begins another.
+ *
+ * Returns the request's ID if it is sampled, 0 if it is not or tracing is
+ * off.
+ */
+uint64_t trace_begin(void) {
+    currentRequest = 0;
+    if (sampleEvery > 0) {
+        uint64_t id = __atomic_add_fetch(&requests, 1, __ATOMIC_RELAXED);
+        if (id % sampleEvery == 0) {
+            currentRequest = id;
+        }
+    }
+    return currentRequest;
+}
+
+/* Returns the ID of the calling thread's current request if it is sampled,
+ * 0 otherwise.
+ */
+uint64_t trace_current(void) {
+    return currentRequest;
+}
+
+/* Finds the buffer in the calling thread's slot, allocating and publishing
+ * one if the slot has none yet.
+ *
+ * Returns the calling thread's buffer.
+ */
+static ThreadTrace* get_trace(void) {
+    if (localTrace) {
+        return localTrace;
+    }
+    ThreadSlot* slot = slots_local();
+    ThreadTrace* trace = slot->blocks[SLOT_TRACE];
+    if (!trace) {
+        trace = calloc(1, sizeof(ThreadTrace));
+        __atomic_store_n(&slot->blocks[SLOT_TRACE], trace, __ATOMIC_RELEASE);
+    }
+    localTrace = trace;
+    return trace;
+}
+
+/* Records a span with the provided name, running from start to end, of the
+ * request with the provided ID in the calling thread's buffer. arg is the
+ * chunk the span belongs to, or TRACE_NO_ARG. Does nothing for request 0,
+ * which is not sampled. name must be a string literal.
+ */
+void trace_span(uint64_t request, const char* name, uint64_t start,
+        uint64_t end, long arg) {
+    if (!request) {
+        return;
+    }
+    ThreadTrace* trace = get_trace();
+    uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+    TraceEvent* event = &trace->events[head % TRACE_EVENTS];
+    event->name = name;
+    event->request = request;
+    event->start = start;
+    event->end = end;
+    event->arg = arg;
+    __atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies the spans in the provided buffer into events.
+ *
+ * Returns the number of spans copied, starting from events[0].
+ */
+static int snapshot(ThreadTrace* trace, TraceEvent* events) {
+    uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+    for (uint64_t i = first; i < head; i++) {
+        events[i - first] = trace->events[i % TRACE_EVENTS];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t now = __atomic_load_n(&trace->head, __ATOMIC_RELAXED);
+    uint64_t skip = now >= first + TRACE_EVENTS
+            ? now - TRACE_EVENTS + 1 - first : 0;
+    if (skip >= head - first) {
+        return 0;
+    }
+    memmove(events, events + skip, sizeof(TraceEvent) * (head - first - skip));
+    return head - first - skip;
+}
+
+/* Writes every span still held by any thread's buffer to out as a Chrome
+ * trace event JSON object, which Perfetto and chrome://tracing can load.
+ * Each span is a complete ("X") event on its thread, with the request it
+ * belongs to and its chunk, if any, as arguments.
+ */
+void trace_write_json(FILE* out) {
+    TraceEvent* events = malloc(sizeof(TraceEvent) * TRACE_EVENTS);
+    bool first = true;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (ThreadSlot* slot = slots_first(); slot; slot = slot->next) {
+        ThreadTrace* trace = __atomic_load_n(&slot->blocks[SLOT_TRACE], 
+                __ATOMIC_ACQUIRE);
+        int n = trace ? snapshot(trace, events) : 0;
+        for (int i = 0; i < n; i++) {
+            TraceEvent* event = &events[i];
+            fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"intserver\","
+                    "\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                    "\"dur\":%.3f,\"args\":{\"request\":%lu",
+                    first ? "" : ",", event->name, slot->id,
+                    event->start / NS_PER_US,
+                    (event->end - event->start) / NS_PER_US, event->request);
+            if (event->arg != TRACE_NO_ARG) {
+                fprintf(out, ",\"chunk\":%ld", event->arg);
+            }
+            fprintf(out, "}}");
+            first = false;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    free(events);
+}
+
+/* Rewrites the trace file at the provided path every TRACE_FLUSH_SECS. The
+ * new trace is written beside it and renamed over it, so readers always see
+ * a complete file. Never returns.
+ */
+static void* flush_thread(void* arg) {
+    const char* path = (const char*)arg;
+    char* temp = malloc(strlen(path) + sizeof(".tmp"));
+    sprintf(temp, "%s.tmp", path);
+    while (true) {
+        sleep(TRACE_FLUSH_SECS);
+        FILE* out = fopen(temp, "w");
+        if (!out) {
+            continue;
+        }
+        trace_write_json(out);
+        if (fclose(out) == 0) {
+            rename(temp, path);
+        }
+    }
+    return NULL;
+}
+
+/* Writes an empty trace to the file at the provided path and starts a
+ * detached thread keeping it up to date.
+ *
+ * Returns false if the file cannot be written, true otherwise.
+ */
+bool trace_flush_to(const char* path) {
+    FILE* out = fopen(path, "w");
+    if (!out) {
+        return false;
+    }
+    trace_write_json(out);
+    fclose(out);
+    pthread_t threadId;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&threadId, &attr, flush_thread, (void*)path);
+    pthread_attr_destroy(&attr);
+    return true;
+}
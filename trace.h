@@ -0,0 +1,25 @@
+/*
+ * trace.h
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Value of a span's arg when it belongs to no particular chunk
+#define TRACE_NO_ARG -1
+
+void trace_enable(long every);
+bool trace_enabled(void);
+uint64_t trace_begin(void);
+uint64_t trace_current(void);
+void trace_span(uint64_t request, const char* name, uint64_t start,
+        uint64_t end, long arg);
+
+void trace_write_json(FILE* out);
+bool trace_flush_to(const char* path);
+
+#endif
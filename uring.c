@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+// Buffer group the provided buffers are registered as
+#define BUF_GROUP 0
+
+// Size of the ring created to check the kernel's support
+#define PROBE_ENTRIES 2
+
+/* Wraps the io_uring_setup system call.
+ */
+static int sys_setup(unsigned entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+/* Wraps the io_uring_enter system call.
+ */
+static int sys_enter(int fd, unsigned toSubmit, unsigned minComplete,
+        unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags,
+            NULL, 0);
+}
+
+/* Wraps the io_uring_register system call.
+ */
+static int sys_register(int fd, unsigned opcode, void* arg,
+        unsigned numArgs) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, numArgs);
+}
+
+/* Maps the submission and completion rings of the provided freshly set up
+ * ring. With IORING_FEAT_SINGLE_MMAP both rings share one mapping.
+ *
+ * Returns false if the rings cannot be mapped, true otherwise.
+ */
+static bool map_rings(Uring* ring, struct io_uring_params* p) {
+    ring->sqRingSize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    ring->cqRingSize = p->cq_off.cqes
+            + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqRingSize > ring->sqRingSize) {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = 0;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        return false;
+    }
+    ring->cqRing = ring->sqRing;
+    if (ring->cqRingSize) {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+            return false;
+        }
+    }
+    ring->sqesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (ring->cqRingSize) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        munmap(ring->sqRing, ring->sqRingSize);
+        return false;
+    }
+
+    char* sq = ring->sqRing;
+    ring->sqHead = (unsigned*)(sq + p->sq_off.head);
+    ring->sqTail = (unsigned*)(sq + p->sq_off.tail);
+    ring->sqMask = *(unsigned*)(sq + p->sq_off.ring_mask);
+    ring->sqArray = (unsigned*)(sq + p->sq_off.array);
+    char* cq = ring->cqRing;
+    ring->cqHead = (unsigned*)(cq + p->cq_off.head);
+    ring->cqTail = (unsigned*)(cq + p->cq_off.tail);
+    ring->cqMask = *(unsigned*)(cq + p->cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+    return true;
+}
+
+/* Allocates numBufs buffers of bufSize bytes, registers a buffer ring for
+ * them with the kernel and hands them all to it. numBufs must be a power
+ * of two.
+ *
+ * Returns false if the kernel does not support buffer rings, true
+ * otherwise.
+ */
+static bool setup_buffers(Uring* ring, unsigned numBufs, unsigned bufSize) {
+    ring->numBufs = numBufs;
+    ring->bufSize = bufSize;
+    ring->bufRingSize = numBufs * sizeof(struct io_uring_buf);
+    ring->bufRing = mmap(NULL, ring->bufRingSize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufRing == MAP_FAILED) {
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->bufRing;
+    reg.ring_entries = numBufs;
+    reg.bgid = BUF_GROUP;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+        munmap(ring->bufRing, ring->bufRingSize);
+        return false;
+    }
+
+    ring->bufs = malloc((size_t)numBufs * bufSize);
+    for (unsigned i = 0; i < numBufs; i++) {
+        struct io_uring_buf* buf = &ring->bufRing->bufs[i];
+        buf->addr = (uintptr_t)(ring->bufs + (size_t)i * bufSize);
+        buf->len = bufSize;
+        buf->bid = i;
+    }
+    __atomic_store_n(&ring->bufRing->tail, numBufs, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Checks if the running kernel supports everything the io_uring backend
+ * relies on by creating and discarding a small ring. Single issuer rings
+ * arrived in the same release as multishot receives, so a kernel that
+ * accepts IORING_SETUP_SINGLE_ISSUER and buffer rings supports multishot
+ * accept and receive too.
+ *
+ * Returns true if io_uring can be used, false otherwise.
+ */
+bool uring_supported(void) {
+    Uring ring;
+    if (!uring_init(&ring, PROBE_ENTRIES, PROBE_ENTRIES, 1)) {
+        return false;
+    }
+    uring_exit(&ring);
+    return true;
+}
+
+/* Creates a ring of the provided number of entries for the calling thread,
+ * along with numBufs provided buffers of bufSize bytes for receives.
+ *
+ * Returns false if the kernel does not support io_uring or any of the
+ * features used, true otherwise.
+ */
+bool uring_init(Uring* ring, unsigned entries, unsigned numBufs,
+        unsigned bufSize) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER;
+    memset(ring, 0, sizeof(Uring));
+    ring->fd = sys_setup(entries, &params);
+    if (ring->fd < 0) {
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_NODROP)
+            || !map_rings(ring, &params)) {
+        close(ring->fd);
+        return false;
+    }
+    if (!setup_buffers(ring, numBufs, bufSize)) {
+        ring->bufRing = NULL;
+        uring_exit(ring);
+        return false;
+    }
+    return true;
+}
+
+/* Tears down the provided ring and frees its buffers.
+ */
+void uring_exit(Uring* ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRingSize) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+    if (ring->bufRing) {
+        munmap(ring->bufRing, ring->bufRingSize);
+    }
+    free(ring->bufs);
+}
+
+/* Takes the next free submission queue entry, submitting what is already
+ * queued first if the queue is full. The entry is cleared and will be
+ * submitted by the next call to uring_submit_and_wait.
+ *
+ * Returns the entry to fill in.
+ */
+struct io_uring_sqe* uring_get_sqe(Uring* ring) {
+    unsigned tail = *ring->sqTail + ring->queued;
+    while (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE)
+            > ring->sqMask) {
+        uring_submit_and_wait(ring, 0);
+        tail = *ring->sqTail + ring->queued;
+    }
+    unsigned index = tail & ring->sqMask;
+    ring->sqArray[index] = index;
+    ring->queued++;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/* Submits every queued entry and waits until at least waitNr completions
+ * are available, in a single system call.
+ *
+ * Returns the number of entries submitted, or a negative errno.
+ */
+int uring_submit_and_wait(Uring* ring, unsigned waitNr) {
+    unsigned toSubmit = ring->queued;
+    __atomic_store_n(ring->sqTail, *ring->sqTail + toSubmit,
+            __ATOMIC_RELEASE);
+    ring->queued = 0;
+    int submitted;
+    do {
+        submitted = sys_enter(ring->fd, toSubmit, waitNr,
+                waitNr ? IORING_ENTER_GETEVENTS : 0);
+    } while (submitted < 0 && errno == EINTR);
+    return submitted < 0 ? -errno : submitted;
+}
+
+/* Takes the oldest completion off the provided ring, copying it to cqe.
+ *
+ * Returns false if there are no completions waiting, true otherwise.
+ */
+bool uring_next_cqe(Uring* ring, struct io_uring_cqe* cqe) {
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *cqe = ring->cqes[head & ring->cqMask];
+    __atomic_store_n(ring->cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Returns the provided buffer a receive completion's data was placed in.
+ */
+char* uring_buffer(Uring* ring, const struct io_uring_cqe* cqe) {
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    return ring->bufs + (size_t)bid * ring->bufSize;
+}
+
+/* Hands the buffer used by the provided receive completion back to the
+ * kernel once its data has been consumed.
+ */
+void uring_recycle(Uring* ring, const struct io_uring_cqe* cqe) {
+    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    unsigned short tail = ring->bufRing->tail;
+    struct io_uring_buf* buf =
+            &ring->bufRing->bufs[tail & (ring->numBufs - 1)];
+    buf->addr = (uintptr_t)(ring->bufs + (size_t)bid * ring->bufSize);
+    buf->len = ring->bufSize;
+    buf->bid = bid;
+    __atomic_store_n(&ring->bufRing->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Prepares a multishot accept on the listening socket fd, which completes
+ * once for every connection accepted.
+ */
+void uring_prep_accept(struct io_uring_sqe* sqe, int fd, uint64_t data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = data;
+}
+
+/* Prepares a multishot receive on the socket fd, which completes each time
+ * data arrives with the data placed in one of the ring's provided buffers.
+ */
+void uring_prep_recv(struct io_uring_sqe* sqe, int fd, uint64_t data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = data;
+}
+
+/* Prepares a send of len bytes from buf on the socket fd.
+ */
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* buf,
+        unsigned len, uint64_t data) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = data;
+}
+
+/* Prepares a read of len bytes into buf from fd.
+ */
+void uring_prep_read(struct io_uring_sqe* sqe, int fd, void* buf,
+        unsigned len, uint64_t data) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->user_data = data;
+}
+
+/* Prepares a cancellation of the operation in flight whose user data is
+ * target.
+ */
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target,
+        uint64_t data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = data;
+}
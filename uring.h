@@ -0,0 +1,62 @@
+/*
+ * uring.h
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+/* Represents an io_uring instance driven through the raw system calls, along
+ * with a ring of provided buffers that multishot receives pick from. Only
+ * the thread that created the ring may submit to it.
+ */
+typedef struct {
+    int fd;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned queued;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    struct io_uring_buf_ring* bufRing;
+    size_t bufRingSize;
+    char* bufs;
+    unsigned numBufs;
+    unsigned bufSize;
+} Uring;
+
+bool uring_supported(void);
+
+bool uring_init(Uring* ring, unsigned entries, unsigned numBufs,
+        unsigned bufSize);
+void uring_exit(Uring* ring);
+
+struct io_uring_sqe* uring_get_sqe(Uring* ring);
+int uring_submit_and_wait(Uring* ring, unsigned waitNr);
+bool uring_next_cqe(Uring* ring, struct io_uring_cqe* cqe);
+
+char* uring_buffer(Uring* ring, const struct io_uring_cqe* cqe);
+void uring_recycle(Uring* ring, const struct io_uring_cqe* cqe);
+
+void uring_prep_accept(struct io_uring_sqe* sqe, int fd, uint64_t data);
+void uring_prep_recv(struct io_uring_sqe* sqe, int fd, uint64_t data);
+void uring_prep_send(struct io_uring_sqe* sqe, int fd, const void* buf,
+        unsigned len, uint64_t data);
+void uring_prep_read(struct io_uring_sqe* sqe, int fd, void* buf,
+        unsigned len, uint64_t data);
+void uring_prep_cancel(struct io_uring_sqe* sqe, uint64_t target,
+        uint64_t data);
+
+#endif